@@ -1,16 +1,52 @@
 #include <algorithm>
+#include <array>
+#include <bitset>
+#include <atomic>
+#include <chrono>
 #include <conio.h>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <condition_variable>
 #include <csignal>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <malloc.h>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <new>
+#include <random>
+#include <set>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
+#include <emmintrin.h>
+#include <intrin.h>
+#include <tmmintrin.h>
+#include <winsock2.h>
+#include <afunix.h>
 #include <windows.h>
+#include <compressapi.h>
+#include <psapi.h>
+
+#pragma comment(lib, "cabinet.lib")
+#pragma comment(lib, "ws2_32.lib")
+
+enum class SpillState : uint8_t {
+  Resident,
+  Cleaning,
+  Clean,
+  Spilled
+};
 
 struct FileEntry {
   std::string name;
@@ -18,160 +54,5878 @@ struct FileEntry {
   size_t size;
   bool isDirectory;
   size_t parent;
+  size_t quota = 0;
+  size_t quotaUsed = 0;
+  size_t quotaRoot = SIZE_MAX;
+  size_t alignment = 0;
+  SpillState spillState = SpillState::Resident;
+  size_t spillOffset = SIZE_MAX;
+  uint64_t lastAccess = 0;
+  uint64_t hostStamp = 0;
+  uint64_t generation = 0;
+};
+
+static std::atomic<bool> allocationTracking{false};
+static std::atomic<uint64_t> allocationCount{0};
+static std::atomic<uint64_t> allocationBytes{0};
+static std::atomic<uint64_t> deallocationCount{0};
+
+void *operator new(size_t size) {
+  if (allocationTracking.load(std::memory_order_relaxed)) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    allocationBytes.fetch_add(size, std::memory_order_relaxed);
+  }
+
+  void *pointer = std::malloc(size > 0 ? size : 1);
+  if (pointer == nullptr) {
+    throw std::bad_alloc();
+  }
+  return pointer;
+}
+
+void operator delete(void *pointer) noexcept {
+  if (pointer != nullptr && allocationTracking.load(std::memory_order_relaxed)) {
+    deallocationCount.fetch_add(1, std::memory_order_relaxed);
+  }
+  std::free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept {
+  operator delete(pointer);
+}
+
+class NullBuffer : public std::streambuf {
+protected:
+  int overflow(int c) override { return traits_type::not_eof(c); }
+  std::streamsize xsputn(const char *, std::streamsize count) override { return count; }
 };
 
-class MemoryConsole {
+struct PerfSample {
+  std::chrono::steady_clock::time_point wall;
+  double cpuSeconds = 0;
+  uint64_t cycles = 0;
+  uint64_t pageFaults = 0;
+  uint64_t allocations = 0;
+  uint64_t allocatedBytes = 0;
+  uint64_t deallocations = 0;
+  bool hasCycles = false;
+};
+
+struct TraceOp {
+  bool allocate;
+  size_t id;
+  size_t size;
+};
+
+struct SpillStats {
+  uint64_t demotions = 0;
+  uint64_t promotions = 0;
+  uint64_t writeBacks = 0;
+  uint64_t spilledWrites = 0;
+  uint64_t residentHits = 0;
+  uint64_t bytesOut = 0;
+  uint64_t bytesIn = 0;
+};
+
+struct AutogrowSettings {
+  bool enabled = false;
+  double factor = 2.0;
+  size_t cap = 0;
+  size_t floor = 0;
+  double lowWater = 0;
+};
+
+struct CommandStats {
+  uint64_t calls = 0;
+  double wallSeconds = 0;
+  uint64_t cycles = 0;
+  uint64_t pageFaults = 0;
+  uint64_t allocations = 0;
+  uint64_t allocatedBytes = 0;
+  uint64_t deallocations = 0;
+};
+
+static constexpr size_t largestAlignment = 2 * 1024 * 1024;
+
+static size_t alignUp(size_t value, size_t alignment) {
+  return (value + alignment - 1) & ~(alignment - 1);
+}
+
+template <bool BestFit>
+class ExtentAllocator {
+public:
+  void reset(size_t begin, size_t end) {
+    byOffset.clear();
+    bySize.clear();
+    freeTotal = 0;
+    limit = end;
+    if (end > begin) {
+      insertExtent(begin, end - begin);
+    }
+  }
+
+  void resize(size_t end) {
+    if (end > limit) {
+      release(limit, end - limit);
+    } else {
+      while (! byOffset.empty()) {
+        auto last = std::prev(byOffset.end());
+        if (last->first + last->second <= end) {
+          break;
+        }
+        const size_t offset = last->first;
+        eraseExtent(last);
+        if (offset < end) {
+          insertExtent(offset, end - offset);
+        }
+      }
+    }
+    limit = end;
+  }
+
+  size_t allocate(size_t size, size_t alignment = 1) {
+    auto fits = [&](size_t begin, size_t length) {
+      const size_t padding = alignUp(begin, alignment) - begin;
+      return padding <= length && length - padding >= size;
+    };
+
+    auto it = byOffset.end();
+    if constexpr (BestFit) {
+      for (auto fit = bySize.lower_bound({size, 0}); fit != bySize.end(); ++fit) {
+        if (fits(fit->second, fit->first)) {
+          it = byOffset.find(fit->second);
+          break;
+        }
+      }
+    } else {
+      for (it = byOffset.begin(); it != byOffset.end() && ! fits(it->first, it->second); ++it) {}
+    }
+    if (it == byOffset.end()) {
+      return SIZE_MAX;
+    }
+
+    const size_t begin = it->first;
+    const size_t end = it->first + it->second;
+    const size_t offset = alignUp(begin, alignment);
+    eraseExtent(it);
+    if (offset > begin) {
+      insertExtent(begin, offset - begin);
+    }
+    if (end > offset + size) {
+      insertExtent(offset + size, end - offset - size);
+    }
+    return offset;
+  }
+
+  void release(size_t offset, size_t size) {
+    if (size == 0) {
+      return;
+    }
+
+    auto next = byOffset.lower_bound(offset);
+    if (next != byOffset.end() && offset + size == next->first) {
+      size += next->second;
+      next = eraseExtent(next);
+    }
+    if (next != byOffset.begin()) {
+      auto previous = std::prev(next);
+      if (previous->first + previous->second == offset) {
+        offset = previous->first;
+        size += previous->second;
+        eraseExtent(previous);
+      }
+    }
+    insertExtent(offset, size);
+  }
+
+  bool reserve(size_t offset, size_t size) {
+    if (size == 0) {
+      return true;
+    }
+
+    auto it = byOffset.upper_bound(offset);
+    if (it == byOffset.begin()) {
+      return false;
+    }
+    --it;
+
+    const size_t begin = it->first;
+    const size_t end = it->first + it->second;
+    if (offset + size > end) {
+      return false;
+    }
+
+    eraseExtent(it);
+    if (offset > begin) {
+      insertExtent(begin, offset - begin);
+    }
+    if (end > offset + size) {
+      insertExtent(offset + size, end - offset - size);
+    }
+    return true;
+  }
+
+  size_t freeBytes() const { return freeTotal; }
+  size_t largestFree() const { return bySize.empty() ? 0 : bySize.rbegin()->first; }
+
 private:
-  std::unique_ptr<uint8_t[]> memory;
-  std::map<std::string, std::string> envVars;
-  bool running;
-  size_t currentPosition;
-  size_t memorySize;
-  std::vector<FileEntry> fileTable;
-  size_t currentDir;
-  size_t dataStart;
+  std::map<size_t, size_t> byOffset;
+  std::set<std::pair<size_t, size_t>> bySize;
+  size_t freeTotal = 0;
+  size_t limit = 0;
 
-  static void signalHandler(int signal) {
-    if (signal == SIGINT) {
-      std::cout << "\nExiting...\n";
-      exit(0);
+  void insertExtent(size_t offset, size_t size) {
+    byOffset[offset] = size;
+    bySize.insert({size, offset});
+    freeTotal += size;
+  }
+
+  std::map<size_t, size_t>::iterator eraseExtent(std::map<size_t, size_t>::iterator it) {
+    bySize.erase({it->second, it->first});
+    freeTotal -= it->second;
+    return byOffset.erase(it);
+  }
+};
+
+using FirstFitAllocator = ExtentAllocator<false>;
+using BestFitAllocator = ExtentAllocator<true>;
+
+// A block's buddy is always offset ^ size.
+class BuddyAllocator {
+public:
+  void reset(size_t begin, size_t end) {
+    for (auto &blocks: freeBlocks) {
+      blocks.clear();
     }
+    allocated.clear();
+    freeTotal = 0;
+    limit = end & ~(minBlock - 1);
+    addFreeRange((begin + minBlock - 1) & ~(minBlock - 1), limit);
   }
 
-  std::string getFullPath(size_t index) {
-    if (index == 0) {
-      return "/";
+  void resize(size_t end) {
+    const size_t newLimit = end & ~(minBlock - 1);
+    if (newLimit > limit) {
+      const size_t oldLimit = limit;
+      limit = newLimit;
+      addFreeRange(oldLimit, newLimit);
+      return;
     }
 
-    std::vector<std::string> parts;
-    size_t current = index;
+    for (size_t order = 0; order < freeBlocks.size(); order++) {
+      auto &blocks = freeBlocks[order];
+      auto it = blocks.lower_bound(newLimit > (1ULL << order) ? newLimit - (1ULL << order) + 1 : 0);
+      while (it != blocks.end()) {
+        const size_t offset = *it;
+        it = blocks.erase(it);
+        freeTotal -= 1ULL << order;
+        if (offset < newLimit) {
+          addFreeRange(offset, newLimit);
+        }
+      }
+    }
+    for (auto it = allocated.rbegin(); it != allocated.rend() && it->second.second > newLimit; ++it) {
+      it->second.second = (std::max)(it->second.first, newLimit);
+    }
+    limit = newLimit;
+  }
 
-    while (current != 0) {
-      parts.push_back(fileTable[current].name);
-      current = fileTable[current].parent;
+  size_t allocate(size_t size, size_t alignment = 1) {
+    size_t order = minOrder;
+    while ((1ULL << order) < (std::max)(size, alignment)) {
+      order++;
     }
 
-    std::string result;
-    for (auto it = parts.rbegin(); it != parts.rend(); ++it) {
-      result += "/" + *it;
+    for (size_t k = order; k < freeBlocks.size(); k++) {
+      if (freeBlocks[k].empty()) {
+        continue;
+      }
+
+      const size_t offset = *freeBlocks[k].begin();
+      freeBlocks[k].erase(freeBlocks[k].begin());
+      freeTotal -= 1ULL << k;
+      while (k > order) {
+        k--;
+        freeBlocks[k].insert(offset + (1ULL << k));
+        freeTotal += 1ULL << k;
+      }
+      allocated[offset] = {offset, offset + (1ULL << order)};
+      return offset;
     }
+    return SIZE_MAX;
+  }
 
-    return result.empty() ? "/" : result;
+  void release(size_t offset, size_t) {
+    auto it = allocated.find(offset);
+    if (it == allocated.end()) {
+      return;
+    }
+    const auto range = it->second;
+    allocated.erase(it);
+    addFreeRange(range.first, (std::min)(range.second, limit));
   }
 
-  void initializeFileSystem() {
-    fileTable.clear();
+  bool reserve(size_t offset, size_t size) {
+    if (size == 0) {
+      return true;
+    }
 
-    FileEntry root = {"", 0, 0, true, 0};
-    fileTable.push_back(root);
+    const size_t begin = offset & ~(minBlock - 1);
+    const size_t end = (offset + size + minBlock - 1) & ~(minBlock - 1);
+    bool available = true;
+    forEachBlock(begin, end, [&](size_t block, size_t order) {
+      available = available && containingFreeOrder(block, order) != SIZE_MAX;
+    });
+    if (! available) {
+      return false;
+    }
 
-    currentDir = 0;
-    dataStart = 1024 * 1024;
+    forEachBlock(begin, end, [&](size_t block, size_t order) {
+      size_t k = containingFreeOrder(block, order);
+      size_t current = block & ~((1ULL << k) - 1);
+      freeBlocks[k].erase(current);
+      freeTotal -= 1ULL << k;
+      while (k > order) {
+        k--;
+        const size_t half = 1ULL << k;
+        const size_t other = (block & half) ? current : current + half;
+        freeBlocks[k].insert(other);
+        freeTotal += half;
+        current = (block & half) ? current + half : current;
+      }
+    });
+    allocated[offset] = {begin, end};
+    return true;
   }
 
-  std::string completeCommand(const std::string &partial) {
-    static const std::vector<std::string> commands = {
-        "help", "env", "peek", "poke", "system", "memsize", "resize", "exit",
-        "ls", "cd", "pwd", "mkdir", "touch", "write", "cat", "rm", "df"};
+  size_t freeBytes() const { return freeTotal; }
 
-    std::vector<std::string> matches;
-    for (const auto &command: commands) {
-      if (command.find(partial) == 0) {
-        matches.push_back(command);
+  size_t largestFree() const {
+    for (size_t order = freeBlocks.size(); order-- > 0;) {
+      if (! freeBlocks[order].empty()) {
+        return 1ULL << order;
       }
     }
+    return 0;
+  }
 
-    for (const auto &entry: fileTable) {
-      if (entry.parent == currentDir && entry.name.find(partial) == 0) {
-        matches.push_back(entry.name);
+private:
+  static constexpr size_t minOrder = 6;
+  static constexpr size_t minBlock = 1ULL << minOrder;
+  std::array<std::set<size_t>, 48> freeBlocks;
+  std::map<size_t, std::pair<size_t, size_t>> allocated;
+  size_t freeTotal = 0;
+  size_t limit = 0;
+
+  template <typename Visitor>
+  static void forEachBlock(size_t begin, size_t end, Visitor visit) {
+    while (begin < end) {
+      size_t order = 47;
+      while ((begin & ((1ULL << order) - 1)) != 0 || (1ULL << order) > end - begin) {
+        order--;
       }
+      visit(begin, order);
+      begin += 1ULL << order;
     }
+  }
 
-    if (matches.size() == 1) {
-      return matches[0];
-    } else if (matches.size() > 1) {
-      std::cout << "\n";
-      for (const auto &match: matches) {
-        std::cout << match << " ";
+  size_t containingFreeOrder(size_t block, size_t order) const {
+    for (size_t k = order; k < freeBlocks.size(); k++) {
+      if (freeBlocks[k].count(block & ~((1ULL << k) - 1)) != 0) {
+        return k;
       }
-      std::cout << "\n";
     }
-    return partial;
+    return SIZE_MAX;
   }
 
-  size_t findFreeSpace(size_t size) {
-    std::vector<std::pair<size_t, size_t>> usedRanges;
+  void addFreeRange(size_t begin, size_t end) {
+    forEachBlock(begin, end, [this](size_t offset, size_t order) {
+      while (order + 1 < freeBlocks.size()) {
+        const size_t buddy = offset ^ (1ULL << order);
+        auto it = freeBlocks[order].find(buddy);
+        if (it == freeBlocks[order].end()) {
+          break;
+        }
+        freeBlocks[order].erase(it);
+        freeTotal -= 1ULL << order;
+        offset = (std::min)(offset, buddy);
+        order++;
+      }
+      freeBlocks[order].insert(offset);
+      freeTotal += 1ULL << order;
+    });
+  }
+};
 
-    for (const auto &file: fileTable) {
-      if (! file.isDirectory && file.size > 0) {
-        usedRanges.push_back({file.offset, file.offset + file.size});
+class BitmapAllocator {
+public:
+  void reset(size_t begin, size_t end) {
+    base = begin;
+    granules = end > begin ? (end - begin) / granuleSize : 0;
+    bitmap.assign(granules / 64 + 2, ~0ULL);
+    markRange(0, granules, false);
+  }
+
+  void resize(size_t end) {
+    const size_t newGranules = end > base ? (end - base) / granuleSize : 0;
+    if (newGranules > granules) {
+      bitmap.resize(newGranules / 64 + 2, ~0ULL);
+      markRange(granules, newGranules, false);
+    } else {
+      markRange(newGranules, granules, true);
+      bitmap.resize(newGranules / 64 + 2);
+    }
+    granules = newGranules;
+  }
+
+  size_t allocate(size_t size, size_t alignment = 1) {
+    const size_t needed = (std::max)(static_cast<size_t>(1), (size + granuleSize - 1) / granuleSize);
+    auto skipFor = [&](size_t granule) {
+      const size_t address = base + granule * granuleSize;
+      return (alignUp(address, alignment) - address + granuleSize - 1) / granuleSize;
+    };
+    const size_t words = (granules + 63) / 64;
+    const __m128i full = _mm_set1_epi8(-1);
+    size_t runStart = 0;
+    size_t runLength = 0;
+
+    for (size_t w = 0; w < words; w++) {
+      if (runLength == 0) {
+        while (w + 2 <= words &&
+               _mm_movemask_epi8(_mm_cmpeq_epi8(
+                   _mm_loadu_si128(reinterpret_cast<const __m128i *>(&bitmap[w])), full)) == 0xFFFF) {
+          w += 2;
+        }
+        if (w >= words) {
+          break;
+        }
+      }
+
+      const uint64_t word = bitmap[w];
+      if (word == 0) {
+        if (runLength == 0) {
+          runStart = w * 64;
+        }
+        runLength += 64;
+        if (runLength >= skipFor(runStart) + needed) {
+          return claim(runStart + skipFor(runStart), needed);
+        }
+        continue;
+      }
+
+      size_t bit = 0;
+      while (bit < 64) {
+        const uint64_t rest = word >> bit;
+        if (rest & 1) {
+          bit += ~rest == 0 ? 64 - bit : (std::min)(64 - bit, static_cast<size_t>(__builtin_ctzll(~rest)));
+          runLength = 0;
+        } else {
+          const size_t count = rest == 0 ? 64 - bit : __builtin_ctzll(rest);
+          if (runLength == 0) {
+            runStart = w * 64 + bit;
+          }
+          runLength += count;
+          bit += count;
+          if (runLength >= skipFor(runStart) + needed) {
+            return claim(runStart + skipFor(runStart), needed);
+          }
+        }
       }
     }
+    return SIZE_MAX;
+  }
 
-    std::sort(usedRanges.begin(), usedRanges.end());
+  void release(size_t offset, size_t size) {
+    if (size == 0) {
+      return;
+    }
+    markRange((offset - base) / granuleSize,
+              (std::min)(granules, (offset + size - base + granuleSize - 1) / granuleSize), false);
+  }
 
-    size_t current = dataStart;
-    for (const auto &range: usedRanges) {
-      if (range.first - current >= size) {
-        return current;
+  bool reserve(size_t offset, size_t size) {
+    if (size == 0) {
+      return true;
+    }
+    const size_t first = (offset - base) / granuleSize;
+    const size_t last = (offset + size - base + granuleSize - 1) / granuleSize;
+    if (offset < base || last > granules) {
+      return false;
+    }
+    for (size_t g = first; g < last; g++) {
+      if (bitmap[g / 64] & (1ULL << (g % 64))) {
+        return false;
       }
+    }
+    markRange(first, last, true);
+    return true;
+  }
 
-      current = range.second;
+  size_t freeBytes() const {
+    size_t used = 0;
+    for (size_t w = 0; w < (granules + 63) / 64; w++) {
+      used += __builtin_popcountll(bitmap[w]);
     }
+    return (((granules + 63) / 64) * 64 - used) * granuleSize;
+  }
 
-    if (memorySize - current >= size) {
-      return current;
+  size_t largestFree() const {
+    size_t best = 0;
+    size_t run = 0;
+    for (size_t g = 0; g < granules; g++) {
+      run = (bitmap[g / 64] & (1ULL << (g % 64))) ? 0 : run + 1;
+      best = (std::max)(best, run);
     }
+    return best * granuleSize;
+  }
 
-    return SIZE_MAX;
+private:
+  static constexpr size_t granuleSize = 64;
+  std::vector<uint64_t> bitmap;
+  size_t base = 0;
+  size_t granules = 0;
+
+  size_t claim(size_t first, size_t count) {
+    markRange(first, first + count, true);
+    return base + first * granuleSize;
   }
 
-  size_t findFile(const std::string &name, size_t parentDir) {
-    for (size_t i = 0; i < fileTable.size(); i++) {
-      if (fileTable[i].name == name && fileTable[i].parent == parentDir) {
-        return i;
+  void markRange(size_t first, size_t last, bool used) {
+    for (size_t g = first; g < last;) {
+      const size_t bit = g % 64;
+      const size_t span = (std::min)(64 - bit, last - g);
+      const uint64_t mask = span == 64 ? ~0ULL : ((1ULL << span) - 1) << bit;
+      if (used) {
+        bitmap[g / 64] |= mask;
+      } else {
+        bitmap[g / 64] &= ~mask;
+      }
+      g += span;
+    }
+  }
+};
+
+static bool writeFileAt(HANDLE handle, uint64_t offset, const void *data, size_t size) {
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  while (size > 0) {
+    OVERLAPPED overlapped = {};
+    overlapped.Offset = static_cast<DWORD>(offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    const DWORD chunk = static_cast<DWORD>((std::min)(size, static_cast<size_t>(1) << 30));
+    DWORD written = 0;
+    if (! WriteFile(handle, bytes, chunk, &written, &overlapped) || written == 0) {
+      return false;
+    }
+    bytes += written;
+    offset += written;
+    size -= written;
+  }
+  return true;
+}
+
+static bool writeAll(HANDLE handle, const void *data, size_t size) {
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  while (size > 0) {
+    const DWORD chunk = static_cast<DWORD>((std::min)(size, static_cast<size_t>(1) << 30));
+    DWORD written = 0;
+    if (! WriteFile(handle, bytes, chunk, &written, nullptr) || written == 0) {
+      return false;
+    }
+    bytes += written;
+    size -= written;
+  }
+  return true;
+}
+
+static bool readFileAt(HANDLE handle, uint64_t offset, void *data, size_t size) {
+  uint8_t *bytes = static_cast<uint8_t *>(data);
+  while (size > 0) {
+    OVERLAPPED overlapped = {};
+    overlapped.Offset = static_cast<DWORD>(offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    const DWORD chunk = static_cast<DWORD>((std::min)(size, static_cast<size_t>(1) << 30));
+    DWORD read = 0;
+    if (! ReadFile(handle, bytes, chunk, &read, &overlapped) || read == 0) {
+      return false;
+    }
+    bytes += read;
+    offset += read;
+    size -= read;
+  }
+  return true;
+}
+
+static void hexEncode(const uint8_t *in, size_t size, uint8_t *out) {
+  const __m128i mask = _mm_set1_epi8(0x0F);
+  const __m128i nine = _mm_set1_epi8(9);
+  const __m128i zero = _mm_set1_epi8('0');
+  const __m128i letterGap = _mm_set1_epi8('a' - '0' - 10);
+  auto toAscii = [&](__m128i nibbles) {
+    return _mm_add_epi8(_mm_add_epi8(nibbles, zero),
+                        _mm_and_si128(_mm_cmpgt_epi8(nibbles, nine), letterGap));
+  };
+
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+    const __m128i high = toAscii(_mm_and_si128(_mm_srli_epi16(bytes, 4), mask));
+    const __m128i low = toAscii(_mm_and_si128(bytes, mask));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * i), _mm_unpacklo_epi8(high, low));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * i + 16), _mm_unpackhi_epi8(high, low));
+  }
+  for (; i < size; i++) {
+    out[2 * i] = "0123456789abcdef"[in[i] >> 4];
+    out[2 * i + 1] = "0123456789abcdef"[in[i] & 0x0F];
+  }
+}
+
+// Returns the input position of the first invalid digit, or SIZE_MAX.
+static size_t hexDecode(const uint8_t *in, size_t size, uint8_t *out) {
+  auto between = [](__m128i value, char low, char high) {
+    return _mm_and_si128(_mm_cmpgt_epi8(value, _mm_set1_epi8(low - 1)),
+                         _mm_cmplt_epi8(value, _mm_set1_epi8(high + 1)));
+  };
+  auto toNibbles = [&](__m128i chars, bool &valid) {
+    const __m128i lower = _mm_or_si128(chars, _mm_set1_epi8(0x20));
+    const __m128i isDigit = between(chars, '0', '9');
+    const __m128i isLetter = between(lower, 'a', 'f');
+    valid = _mm_movemask_epi8(_mm_or_si128(isDigit, isLetter)) == 0xFFFF;
+    return _mm_or_si128(_mm_and_si128(isDigit, _mm_sub_epi8(chars, _mm_set1_epi8('0'))),
+                        _mm_and_si128(isLetter, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+  };
+  auto combine = [](__m128i nibbles) {
+    const __m128i high = _mm_slli_epi16(_mm_and_si128(nibbles, _mm_set1_epi16(0x00FF)), 4);
+    return _mm_or_si128(high, _mm_srli_epi16(nibbles, 8));
+  };
+
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    bool firstValid = false;
+    bool secondValid = false;
+    const __m128i first = toNibbles(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i)), firstValid);
+    const __m128i second = toNibbles(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i + 16)), secondValid);
+    if (! firstValid || ! secondValid) {
+      break;
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i / 2),
+                     _mm_packus_epi16(combine(first), combine(second)));
+  }
+
+  auto digit = [](uint8_t c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+  };
+  for (; i < size; i += 2) {
+    const int high = digit(in[i]);
+    const int low = digit(in[i + 1]);
+    if (high < 0 || low < 0) {
+      return high < 0 ? i : i + 1;
+    }
+    out[i / 2] = static_cast<uint8_t>(high << 4 | low);
+  }
+  return SIZE_MAX;
+}
+
+static bool hasSsse3() {
+  static const bool supported = [] {
+    int info[4] = {};
+    __cpuid(info, 1);
+    return (info[2] & (1 << 9)) != 0;
+  }();
+  return supported;
+}
+
+// Returns the position of the first non-hex byte, or SIZE_MAX.
+static size_t hexFindInvalid(const uint8_t *in, size_t size) {
+  auto between = [](__m128i value, char low, char high) {
+    return _mm_and_si128(_mm_cmpgt_epi8(value, _mm_set1_epi8(low - 1)),
+                         _mm_cmplt_epi8(value, _mm_set1_epi8(high + 1)));
+  };
+
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    const __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+    const __m128i lower = _mm_or_si128(chars, _mm_set1_epi8(0x20));
+    if (_mm_movemask_epi8(_mm_or_si128(between(chars, '0', '9'), between(lower, 'a', 'f'))) != 0xFFFF) {
+      break;
+    }
+  }
+  for (; i < size; i++) {
+    const uint8_t lower = in[i] | 0x20;
+    if (! (in[i] >= '0' && in[i] <= '9') && ! (lower >= 'a' && lower <= 'f')) {
+      return i;
+    }
+  }
+  return SIZE_MAX;
+}
+
+static const std::array<uint8_t, 256> &base64Values() {
+  static const auto values = [] {
+    std::array<uint8_t, 256> table;
+    table.fill(0xFF);
+    const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for (uint8_t i = 0; i < 64; i++) {
+      table[static_cast<uint8_t>(alphabet[i])] = i;
+    }
+    return table;
+  }();
+  return values;
+}
+
+// SSSE3 kernels after Mula and Lemire; the scalar loops finish the tail.
+__attribute__((target("ssse3")))
+static size_t base64EncodeSsse3(const uint8_t *in, size_t size, uint8_t *out) {
+  const __m128i spread = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+  const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  size_t i = 0;
+  for (; i + 16 <= size; i += 12, out += 16) {
+    const __m128i bytes = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i)), spread);
+    const __m128i high = _mm_mulhi_epu16(_mm_and_si128(bytes, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040));
+    const __m128i low = _mm_mullo_epi16(_mm_and_si128(bytes, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010));
+    const __m128i indices = _mm_or_si128(high, low);
+    __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    range = _mm_or_si128(range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices), _mm_set1_epi8(13)));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_add_epi8(indices, _mm_shuffle_epi8(offsets, range)));
+  }
+  return i;
+}
+
+__attribute__((target("ssse3")))
+static __m128i base64Classify(__m128i chars, bool &valid) {
+  const __m128i lowTable = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A,
+                                         0x1B, 0x1B, 0x1B, 0x1A);
+  const __m128i highTable = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10,
+                                          0x10, 0x10, 0x10, 0x10);
+  const __m128i rollTable = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i mask = _mm_set1_epi8(0x2F);
+  const __m128i highNibbles = _mm_and_si128(_mm_srli_epi32(chars, 4), mask);
+  const __m128i low = _mm_shuffle_epi8(lowTable, _mm_and_si128(chars, mask));
+  const __m128i high = _mm_shuffle_epi8(highTable, highNibbles);
+  valid = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(low, high), _mm_setzero_si128())) == 0xFFFF;
+  const __m128i roll = _mm_shuffle_epi8(rollTable, _mm_add_epi8(_mm_cmpeq_epi8(chars, mask), highNibbles));
+  return _mm_add_epi8(chars, roll);
+}
+
+__attribute__((target("ssse3")))
+static size_t base64ValidPrefixSsse3(const uint8_t *in, size_t size) {
+  size_t i = 0;
+  bool valid = true;
+  for (; i + 16 <= size; i += 16) {
+    base64Classify(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i)), valid);
+    if (! valid) {
+      break;
+    }
+  }
+  return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t base64DecodeSsse3(const uint8_t *in, size_t size, uint8_t *out) {
+  const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  size_t i = 0;
+  bool valid = true;
+  for (; i + 32 <= size; i += 16, out += 12) {
+    const __m128i values = base64Classify(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i)), valid);
+    if (! valid) {
+      break;
+    }
+    const __m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    const __m128i words = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_shuffle_epi8(words, pack));
+  }
+  return i;
+}
+
+static void base64Encode(const uint8_t *in, size_t size, uint8_t *out) {
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  static const auto pairs = [] {
+    std::array<uint16_t, 4096> table;
+    for (size_t i = 0; i < table.size(); i++) {
+      table[i] = static_cast<uint16_t>(static_cast<uint8_t>(alphabet[i >> 6]) |
+                                       static_cast<uint8_t>(alphabet[i & 0x3F]) << 8);
+    }
+    return table;
+  }();
+
+  size_t i = hasSsse3() ? base64EncodeSsse3(in, size, out) : 0;
+  for (out += i / 3 * 4; i + 3 <= size; i += 3, out += 4) {
+    const uint32_t bits = static_cast<uint32_t>(in[i]) << 16 | in[i + 1] << 8 | in[i + 2];
+    std::memcpy(out, &pairs[bits >> 12], 2);
+    std::memcpy(out + 2, &pairs[bits & 0xFFF], 2);
+  }
+  if (i < size) {
+    const uint32_t bits = static_cast<uint32_t>(in[i]) << 16 | (i + 1 < size ? in[i + 1] << 8 : 0);
+    out[0] = alphabet[bits >> 18];
+    out[1] = alphabet[(bits >> 12) & 0x3F];
+    out[2] = i + 1 < size ? alphabet[(bits >> 6) & 0x3F] : '=';
+    out[3] = '=';
+  }
+}
+
+// Padding must already be stripped. Returns SIZE_MAX if all valid.
+static size_t base64FindInvalid(const uint8_t *in, size_t size) {
+  const auto &values = base64Values();
+  for (size_t i = hasSsse3() ? base64ValidPrefixSsse3(in, size) : 0; i < size; i++) {
+    if (values[in[i]] & 0x80) {
+      return i;
+    }
+  }
+  return SIZE_MAX;
+}
+
+static size_t base64Decode(const uint8_t *in, size_t size, uint8_t *out) {
+  const auto &values = base64Values();
+
+  size_t i = hasSsse3() ? base64DecodeSsse3(in, size, out) : 0;
+  for (out += i / 4 * 3; i + 4 <= size; i += 4, out += 3) {
+    const uint8_t a = values[in[i]];
+    const uint8_t b = values[in[i + 1]];
+    const uint8_t c = values[in[i + 2]];
+    const uint8_t d = values[in[i + 3]];
+    if ((a | b | c | d) & 0x80) {
+      break;
+    }
+    const uint32_t bits = static_cast<uint32_t>(a) << 18 | b << 12 | c << 6 | d;
+    out[0] = static_cast<uint8_t>(bits >> 16);
+    out[1] = static_cast<uint8_t>(bits >> 8);
+    out[2] = static_cast<uint8_t>(bits);
+  }
+
+  uint32_t bits = 0;
+  const size_t start = i;
+  for (; i < size; i++) {
+    if (values[in[i]] & 0x80) {
+      return i;
+    }
+    bits = bits << 6 | values[in[i]];
+    if ((i - start) % 4 == 3) {
+      out[0] = static_cast<uint8_t>(bits >> 16);
+      out[1] = static_cast<uint8_t>(bits >> 8);
+      out[2] = static_cast<uint8_t>(bits);
+      out += 3;
+      bits = 0;
+    }
+  }
+  switch ((i - start) % 4) {
+    case 2: out[0] = static_cast<uint8_t>(bits >> 4); break;
+    case 3: out[0] = static_cast<uint8_t>(bits >> 10); out[1] = static_cast<uint8_t>(bits >> 2); break;
+  }
+  return SIZE_MAX;
+}
+
+// Passes are bounded so the 32-bit counts cannot wrap.
+static void countBytes(const uint8_t *data, size_t size, uint64_t *counts) {
+  const size_t passLimit = static_cast<size_t>(1) << 30;
+  while (size > 0) {
+    uint32_t tables[4][256] = {};
+    const size_t pass = (std::min)(size, passLimit);
+    size_t i = 0;
+    for (; i + 8 <= pass; i += 8) {
+      uint64_t word;
+      std::memcpy(&word, data + i, sizeof(word));
+      tables[0][word & 0xFF]++;
+      tables[1][(word >> 8) & 0xFF]++;
+      tables[2][(word >> 16) & 0xFF]++;
+      tables[3][(word >> 24) & 0xFF]++;
+      tables[0][(word >> 32) & 0xFF]++;
+      tables[1][(word >> 40) & 0xFF]++;
+      tables[2][(word >> 48) & 0xFF]++;
+      tables[3][word >> 56]++;
+    }
+    for (; i < pass; i++) {
+      tables[0][data[i]]++;
+    }
+    for (size_t value = 0; value < 256; value++) {
+      counts[value] += static_cast<uint64_t>(tables[0][value]) + tables[1][value] +
+                       tables[2][value] + tables[3][value];
+    }
+    data += pass;
+    size -= pass;
+  }
+}
+
+static double shannonEntropy(const uint64_t *counts, size_t total) {
+  double entropy = 0;
+  for (size_t value = 0; value < 256; value++) {
+    if (counts[value] > 0) {
+      const double p = static_cast<double>(counts[value]) / total;
+      entropy -= p * std::log2(p);
+    }
+  }
+  return entropy;
+}
+
+template <typename T>
+static T byteSwap(T value) {
+  uint8_t bytes[sizeof(T)];
+  std::memcpy(bytes, &value, sizeof(T));
+  std::reverse(bytes, bytes + sizeof(T));
+  std::memcpy(&value, bytes, sizeof(T));
+  return value;
+}
+
+// Calls visit with a value of the scalar type named by a peek/poke suffix.
+template <typename Visitor>
+static bool withScalarType(const std::string &name, Visitor visit) {
+  if (name == "u8") visit(uint8_t{});
+  else if (name == "i8") visit(int8_t{});
+  else if (name == "u16") visit(uint16_t{});
+  else if (name == "i16") visit(int16_t{});
+  else if (name == "u32") visit(uint32_t{});
+  else if (name == "i32") visit(int32_t{});
+  else if (name == "u64") visit(uint64_t{});
+  else if (name == "i64") visit(int64_t{});
+  else if (name == "f32") visit(float{});
+  else if (name == "f64") visit(double{});
+  else return false;
+  return true;
+}
+
+static bool isZeroBlock(const uint8_t *data, size_t size) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i any = zero;
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    const __m128i *lane = reinterpret_cast<const __m128i *>(data + i);
+    any = _mm_or_si128(any, _mm_or_si128(_mm_or_si128(_mm_loadu_si128(lane), _mm_loadu_si128(lane + 1)),
+                                         _mm_or_si128(_mm_loadu_si128(lane + 2), _mm_loadu_si128(lane + 3))));
+  }
+  bool zeroTail = true;
+  for (; i < size; i++) {
+    zeroTail = zeroTail && data[i] == 0;
+  }
+  return zeroTail && _mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) == 0xFFFF;
+}
+
+static size_t firstDifference(const uint8_t *a, const uint8_t *b, size_t size) {
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    const __m128i *x = reinterpret_cast<const __m128i *>(a + i);
+    const __m128i *y = reinterpret_cast<const __m128i *>(b + i);
+    const __m128i equal = _mm_and_si128(
+        _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(x), _mm_loadu_si128(y)),
+                      _mm_cmpeq_epi8(_mm_loadu_si128(x + 1), _mm_loadu_si128(y + 1))),
+        _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(x + 2), _mm_loadu_si128(y + 2)),
+                      _mm_cmpeq_epi8(_mm_loadu_si128(x + 3), _mm_loadu_si128(y + 3))));
+    if (_mm_movemask_epi8(equal) != 0xFFFF) {
+      break;
+    }
+  }
+  for (; i < size && a[i] == b[i]; i++) {
+  }
+  return i;
+}
+
+static size_t firstEqualBlock(const uint8_t *a, const uint8_t *b, size_t size) {
+  for (size_t i = 0; i + 16 <= size; i += 16) {
+    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+    const __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) == 0xFFFF) {
+      return i;
+    }
+  }
+  return size;
+}
+
+static bool startWinsock() {
+  static const bool started = [] {
+    WSADATA data;
+    return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+  }();
+  return started;
+}
+
+static bool sendAll(SOCKET socket, const void *data, size_t size) {
+  const char *bytes = static_cast<const char *>(data);
+  while (size > 0) {
+    const int sent = send(socket, bytes, static_cast<int>((std::min)(size, static_cast<size_t>(1) << 30)), 0);
+    if (sent <= 0) {
+      return false;
+    }
+    bytes += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+static bool recvAll(SOCKET socket, void *data, size_t size) {
+  char *bytes = static_cast<char *>(data);
+  while (size > 0) {
+    const int received = recv(socket, bytes, static_cast<int>((std::min)(size, static_cast<size_t>(1) << 30)), 0);
+    if (received <= 0) {
+      return false;
+    }
+    bytes += received;
+    size -= received;
+  }
+  return true;
+}
+
+static sockaddr_un unixAddress(const std::string &path) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+  return address;
+}
+
+static std::string percentDecode(const std::string &text) {
+  std::string result;
+  for (size_t i = 0; i < text.size(); i++) {
+    if (text[i] == '%' && i + 2 < text.size() && std::isxdigit(static_cast<unsigned char>(text[i + 1])) &&
+        std::isxdigit(static_cast<unsigned char>(text[i + 2]))) {
+      result += static_cast<char>(std::stoi(text.substr(i + 1, 2), nullptr, 16));
+      i += 2;
+    } else {
+      result += text[i];
+    }
+  }
+  return result;
+}
+
+static std::string percentEncode(const std::string &text) {
+  static const char digits[] = "0123456789ABCDEF";
+  std::string result;
+  for (unsigned char c: text) {
+    if (std::isalnum(c) || (c != 0 && std::strchr("-._~", c) != nullptr)) {
+      result += static_cast<char>(c);
+    } else {
+      result += '%';
+      result += digits[c >> 4];
+      result += digits[c & 15];
+    }
+  }
+  return result;
+}
+
+static std::string htmlEscape(const std::string &text) {
+  std::string result;
+  for (char c: text) {
+    switch (c) {
+      case '&': result += "&amp;"; break;
+      case '<': result += "&lt;"; break;
+      case '>': result += "&gt;"; break;
+      case '"': result += "&quot;"; break;
+      default: result += c;
+    }
+  }
+  return result;
+}
+
+// Apply's offset is the sequence number; Spill's is the entry index.
+enum class StreamRecord : uint64_t { Begin, Resize, Pages, Commit, Ack, Apply, Spill };
+
+struct StreamHeader {
+  StreamRecord type;
+  uint64_t offset;
+  uint64_t length;
+};
+
+static void appendRecord(std::vector<uint8_t> &out, const StreamHeader &header, const void *payload) {
+  const auto *bytes = reinterpret_cast<const uint8_t *>(&header);
+  out.insert(out.end(), bytes, bytes + sizeof(header));
+  if (payload != nullptr) {
+    out.insert(out.end(), static_cast<const uint8_t *>(payload),
+               static_cast<const uint8_t *>(payload) + header.length);
+  }
+}
+
+static uint32_t crc32(const uint8_t *data, size_t size) {
+  static const auto tables = [] {
+    std::array<std::array<uint32_t, 256>, 8> t;
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; bit++) {
+        crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+      }
+      t[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+      for (size_t slice = 1; slice < 8; slice++) {
+        t[slice][i] = (t[slice - 1][i] >> 8) ^ t[0][t[slice - 1][i] & 0xFF];
+      }
+    }
+    return t;
+  }();
+
+  uint32_t crc = 0xFFFFFFFFu;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, data + i, sizeof(word));
+    word ^= crc;
+    crc = tables[7][word & 0xFF] ^ tables[6][(word >> 8) & 0xFF] ^ tables[5][(word >> 16) & 0xFF] ^
+          tables[4][(word >> 24) & 0xFF] ^ tables[3][(word >> 32) & 0xFF] ^
+          tables[2][(word >> 40) & 0xFF] ^ tables[1][(word >> 48) & 0xFF] ^ tables[0][word >> 56];
+  }
+  for (; i < size; i++) {
+    crc = (crc >> 8) ^ tables[0][(crc ^ data[i]) & 0xFF];
+  }
+  return ~crc;
+}
+
+enum class ChunkEncoding : uint32_t { Zero, Raw, Xpress };
+
+struct ImageChunk {
+  uint64_t fileOffset;
+  uint64_t storedLength;
+  ChunkEncoding encoding;
+  uint32_t crc;
+};
+
+static void appendU64(std::string &out, uint64_t value) {
+  out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static bool readU64(const uint8_t *&cursor, const uint8_t *end, uint64_t &value) {
+  if (end - cursor < static_cast<ptrdiff_t>(sizeof(value))) {
+    return false;
+  }
+  std::memcpy(&value, cursor, sizeof(value));
+  cursor += sizeof(value);
+  return true;
+}
+
+class SpillFile {
+public:
+  SpillFile() = default;
+  SpillFile(const SpillFile &) = delete;
+  SpillFile &operator=(const SpillFile &) = delete;
+  ~SpillFile() { close(); }
+
+  bool open(const std::string &path) {
+    close();
+    handle = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+                         CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE,
+                         nullptr);
+    if (handle == INVALID_HANDLE_VALUE) {
+      return false;
+    }
+    filePath = path;
+    capacityBytes = 0;
+    usedBytes = 0;
+    extents.reset(0, 0);
+    return true;
+  }
+
+  void close() {
+    if (writer.joinable()) {
+      {
+        std::lock_guard<std::mutex> guard(mutex);
+        stopping = true;
+      }
+      changed.notify_all();
+      writer.join();
+      stopping = false;
+    }
+    if (handle != INVALID_HANDLE_VALUE) {
+      CloseHandle(handle);
+      handle = INVALID_HANDLE_VALUE;
+    }
+  }
+
+  bool isOpen() const { return handle != INVALID_HANDLE_VALUE; }
+  const std::string &path() const { return filePath; }
+  size_t capacity() const { return capacityBytes; }
+  size_t used() const { return usedBytes; }
+
+  size_t allocate(size_t size) {
+    size_t offset = extents.allocate(size);
+    if (offset == SIZE_MAX) {
+      capacityBytes = (std::max)({capacityBytes * 2, capacityBytes + size,
+                                  static_cast<size_t>(64) * 1024 * 1024});
+      extents.resize(capacityBytes);
+      offset = extents.allocate(size);
+    }
+    if (offset != SIZE_MAX) {
+      usedBytes += size;
+    }
+    return offset;
+  }
+
+  void release(size_t offset, size_t size) {
+    wait(offset);
+    extents.release(offset, size);
+    usedBytes -= size;
+  }
+
+  bool write(size_t offset, const uint8_t *data, size_t size) {
+    return writeFileAt(handle, offset, data, size);
+  }
+
+  bool read(size_t offset, uint8_t *data, size_t size) {
+    return readFileAt(handle, offset, data, size);
+  }
+
+  void writeAsync(size_t offset, const uint8_t *data, size_t size) {
+    {
+      std::lock_guard<std::mutex> guard(mutex);
+      queue.push_back({offset, data, size});
+      pending.insert(offset);
+    }
+    if (! writer.joinable()) {
+      writer = std::thread([this] { writerLoop(); });
+    }
+    changed.notify_all();
+  }
+
+  bool isPending(size_t offset) {
+    std::lock_guard<std::mutex> guard(mutex);
+    return pending.count(offset) != 0;
+  }
+
+  void wait(size_t offset) {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&] { return pending.count(offset) == 0; });
+  }
+
+  void drain() {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&] { return pending.empty(); });
+  }
+
+private:
+  struct Job {
+    size_t offset;
+    const uint8_t *data;
+    size_t size;
+  };
+
+  HANDLE handle = INVALID_HANDLE_VALUE;
+  std::string filePath;
+  FirstFitAllocator extents;
+  size_t capacityBytes = 0;
+  size_t usedBytes = 0;
+  std::thread writer;
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<Job> queue;
+  std::set<size_t> pending;
+  bool stopping = false;
+
+  void writerLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      changed.wait(lock, [&] { return stopping || ! queue.empty(); });
+      if (queue.empty()) {
+        return;
+      }
+
+      const Job job = queue.front();
+      queue.pop_front();
+      lock.unlock();
+      writeFileAt(handle, job.offset, job.data, job.size);
+      lock.lock();
+      pending.erase(job.offset);
+      changed.notify_all();
+    }
+  }
+};
+
+class LinearDirectoryIndex {
+public:
+  size_t find(const std::vector<FileEntry> &table, const std::string &name,
+              size_t parent) const {
+    for (size_t i = 0; i < table.size(); i++) {
+      if (table[i].name == name && table[i].parent == parent) {
+        return i;
+      }
+    }
+    return SIZE_MAX;
+  }
+
+  void insert(const std::vector<FileEntry> &, size_t) {}
+  void rebuild(const std::vector<FileEntry> &) {}
+};
+
+class HashedDirectoryIndex {
+public:
+  size_t find(const std::vector<FileEntry> &, const std::string &name,
+              size_t parent) const {
+    auto dir = children.find(parent);
+    if (dir == children.end()) {
+      return SIZE_MAX;
+    }
+    auto entry = dir->second.find(name);
+    return entry == dir->second.end() ? SIZE_MAX : entry->second;
+  }
+
+  void insert(const std::vector<FileEntry> &table, size_t index) {
+    children[table[index].parent].emplace(table[index].name, index);
+  }
+
+  void rebuild(const std::vector<FileEntry> &table) {
+    children.clear();
+    for (size_t i = 0; i < table.size(); i++) {
+      insert(table, i);
+    }
+  }
+
+private:
+  std::unordered_map<size_t, std::unordered_map<std::string, size_t>> children;
+};
+
+class HeapBacking {
+public:
+  uint8_t *resize(size_t oldSize, size_t newSize) {
+    std::unique_ptr<uint8_t[], AlignedDelete> newMemory(
+        static_cast<uint8_t *>(_aligned_malloc((std::max)(newSize, static_cast<size_t>(1)), largestAlignment)));
+    if (! newMemory) {
+      throw std::bad_alloc();
+    }
+    std::fill_n(newMemory.get(), newSize, 0);
+
+    if (memory) {
+      std::copy_n(memory.get(), (std::min)(oldSize, newSize), newMemory.get());
+    }
+
+    memory = std::move(newMemory);
+    return memory.get();
+  }
+
+  void swap(HeapBacking &other) { memory.swap(other.memory); }
+
+private:
+  struct AlignedDelete {
+    void operator()(uint8_t *pointer) const { _aligned_free(pointer); }
+  };
+
+  std::unique_ptr<uint8_t[], AlignedDelete> memory;
+};
+
+class VirtualBacking {
+public:
+  VirtualBacking() = default;
+  VirtualBacking(const VirtualBacking &) = delete;
+  VirtualBacking &operator=(const VirtualBacking &) = delete;
+
+  ~VirtualBacking() {
+    if (reservation != nullptr) {
+      VirtualFree(reservation, 0, MEM_RELEASE);
+    }
+  }
+
+  uint8_t *resize(size_t oldSize, size_t newSize) {
+    if (base != nullptr && newSize <= reserved) {
+      if (newSize > oldSize) {
+        if (VirtualAlloc(base, newSize, MEM_COMMIT, PAGE_READWRITE) == nullptr) {
+          throw std::bad_alloc();
+        }
+      } else {
+        const size_t keep = (newSize + pageSize - 1) & ~(pageSize - 1);
+        std::fill(base + newSize, base + (std::min)(keep, oldSize), 0);
+        if (oldSize > keep) {
+          VirtualFree(base + keep, oldSize - keep, MEM_DECOMMIT);
+        }
+      }
+      return base;
+    }
+
+    const size_t newReserved = (std::max)(newSize, defaultReservation);
+    auto *newReservation = static_cast<uint8_t *>(
+        VirtualAlloc(nullptr, newReserved + largestAlignment, MEM_RESERVE, PAGE_READWRITE));
+    auto *newBase = reinterpret_cast<uint8_t *>(
+        alignUp(reinterpret_cast<size_t>(newReservation), largestAlignment));
+    if (newReservation == nullptr ||
+        VirtualAlloc(newBase, newSize, MEM_COMMIT, PAGE_READWRITE) == nullptr) {
+      if (newReservation != nullptr) {
+        VirtualFree(newReservation, 0, MEM_RELEASE);
+      }
+      throw std::bad_alloc();
+    }
+
+    if (base != nullptr) {
+      std::copy_n(base, (std::min)(oldSize, newSize), newBase);
+      VirtualFree(reservation, 0, MEM_RELEASE);
+    }
+    reservation = newReservation;
+    base = newBase;
+    reserved = newReserved;
+    return base;
+  }
+
+  void swap(VirtualBacking &other) {
+    std::swap(reservation, other.reservation);
+    std::swap(base, other.base);
+    std::swap(reserved, other.reserved);
+  }
+
+private:
+  static constexpr size_t defaultReservation = 256ULL * 1024 * 1024 * 1024;
+  static constexpr size_t pageSize = 4096;
+  uint8_t *reservation = nullptr;
+  uint8_t *base = nullptr;
+  size_t reserved = 0;
+};
+
+class SingleThreaded {
+public:
+  class Lock {
+  public:
+    explicit Lock(SingleThreaded &) {}
+  };
+
+  static constexpr bool concurrent = false;
+};
+
+class MultiThreaded {
+public:
+  class Lock {
+  public:
+    explicit Lock(MultiThreaded &sync) : guard(sync.mutex) {}
+
+  private:
+    std::lock_guard<std::recursive_mutex> guard;
+  };
+
+  static constexpr bool concurrent = true;
+
+private:
+  std::recursive_mutex mutex;
+};
+
+template <typename Allocator, typename DirectoryIndex, typename Backing,
+          typename Sync>
+class BasicMemoryConsole {
+private:
+  Backing backing;
+  Allocator allocator;
+  DirectoryIndex directoryIndex;
+  Sync sync;
+  uint8_t *memory = nullptr;
+  std::map<std::string, std::string> envVars;
+  bool running;
+  size_t currentPosition;
+  size_t memorySize;
+  std::vector<FileEntry> fileTable;
+  size_t currentDir;
+  size_t dataStart;
+  std::vector<uint64_t> accessHeat;
+  std::map<std::string, CommandStats> commandStats;
+  bool outputSuppressed = false;
+  AutogrowSettings autogrow;
+  size_t defaultAlignment = 1;
+  std::vector<uint8_t> inputCarry;
+
+  static constexpr size_t trackedPageSize = 4096;
+  std::vector<uint64_t> dirtyPages;
+  std::thread migrationThread;
+  std::atomic<bool> migrating{false};
+  std::string migratedTo;
+  std::string migrationReport;
+  bool announceGrowth = true;
+
+  struct Replication {
+    SOCKET socket = INVALID_SOCKET;
+    std::string path;
+    std::thread shipper;
+    std::thread ackReader;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable drained;
+    std::deque<std::vector<uint8_t>> queue;
+    std::map<uint64_t, std::chrono::steady_clock::time_point> inFlight;
+    std::string shippedHeader;
+    std::vector<std::string> shippedEntries;
+    std::string problem;
+    size_t sentSize = 0;
+    size_t queuedBytes = 0;
+    uint64_t shipped = 0;
+    uint64_t acked = 0;
+    double ackLag = 0;
+    bool stopping = false;
+    std::atomic<bool> active{false};
+  } replication;
+
+  struct Follower {
+    SOCKET listener = INVALID_SOCKET;
+    std::atomic<SOCKET> socket{INVALID_SOCKET};
+    std::string path;
+    std::thread receiver;
+    std::atomic<bool> connected{false};
+    std::atomic<bool> promoted{false};
+    bool readOnly = false;
+    std::string problem;
+    uint64_t applied = 0;
+    double applyLag = 0;
+    std::chrono::steady_clock::time_point lastApply;
+  } follower;
+
+  struct HttpConnection {
+    SOCKET socket = INVALID_SOCKET;
+    std::string input;
+    std::string output;
+    size_t outputSent = 0;
+    size_t file = SIZE_MAX;
+    uint64_t generation = 0;
+    size_t extent = 0;
+    bool spilled = false;
+    size_t bodyNext = 0;
+    size_t bodyEnd = 0;
+    bool closeAfter = false;
+    bool closed = false;
+    std::chrono::steady_clock::time_point lastActive;
+  };
+
+  struct HttpServer {
+    SOCKET listener = INVALID_SOCKET;
+    std::thread loop;
+    std::atomic<bool> stopping{false};
+    uint16_t port = 0;
+    std::atomic<size_t> connections{0};
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> bytesSent{0};
+  } httpServer;
+
+  struct ImageLoad {
+    std::thread thread;
+    std::string path;
+    size_t total = 0;
+    size_t chunkSize = 0;
+    std::atomic<size_t> done{0};
+    std::mutex mutex;
+    std::vector<size_t> corrupt;
+    std::chrono::steady_clock::time_point start;
+  } imageLoad;
+  SpillFile spill;
+  SpillStats spillStats;
+  uint64_t accessClock = 0;
+  uint64_t fileGeneration = 0;
+  size_t writeBackCursor = 0;
+
+  static constexpr uint64_t coldAge = 32;
+
+  static constexpr size_t heatRegions = 256;
+  static constexpr size_t fragmapWidth = 64;
+
+  static void signalHandler(int signal) {
+    if (signal == SIGINT) {
+      std::cout << "\nExiting...\n";
+      exit(0);
+    }
+  }
+
+  std::string getFullPath(size_t index) {
+    return pathIn(fileTable, index);
+  }
+
+  // Stops on dangling or cyclic parent chains read from images.
+  static std::string pathIn(const std::vector<FileEntry> &files, size_t index) {
+    if (index == 0) {
+      return "/";
+    }
+
+    std::vector<std::string> parts;
+    size_t current = index;
+
+    while (current != 0 && current < files.size() && parts.size() < files.size()) {
+      parts.push_back(files[current].name);
+      current = files[current].parent;
+    }
+
+    std::string result;
+    for (auto it = parts.rbegin(); it != parts.rend(); ++it) {
+      result += "/" + *it;
+    }
+
+    return result.empty() ? "/" : result;
+  }
+
+  void initializeFileSystem() {
+    fileTable.clear();
+
+    FileEntry root = {"", 0, 0, true, 0};
+    fileTable.push_back(root);
+
+    currentDir = 0;
+    dataStart = 1024 * 1024;
+    allocator.reset(dataStart, memorySize);
+    directoryIndex.rebuild(fileTable);
+  }
+
+  std::string completeCommand(const std::string &partial) {
+    static const std::vector<std::string> commands = {
+        "help", "env", "peek", "poke", "system", "memsize", "resize", "autogrow", "spill", "exit",
+        "ls", "cd", "pwd", "mkdir", "touch", "write", "cat", "rm", "align", "export", "hexenc", "hexdec", "b64enc", "b64dec", "dump", "undump", "sync", "histogram", "entropy", "save", "load", "diff", "snapdiff", "migrate", "replicate", "replstatus", "promote", "serve", "df",
+        "quota", "fragmap", "fsck", "membench", "allocbench", "stats", "prof", "alloctrack", "time", "repeat"};
+
+    std::vector<std::string> matches;
+    for (const auto &command: commands) {
+      if (command.find(partial) == 0) {
+        matches.push_back(command);
+      }
+    }
+
+    for (const auto &entry: fileTable) {
+      if (entry.parent == currentDir && entry.name.find(partial) == 0) {
+        matches.push_back(entry.name);
+      }
+    }
+
+    if (matches.size() == 1) {
+      return matches[0];
+    } else if (matches.size() > 1) {
+      std::cout << "\n";
+      for (const auto &match: matches) {
+        std::cout << match << " ";
+      }
+      std::cout << "\n";
+    }
+    return partial;
+  }
+
+  std::vector<std::pair<size_t, size_t>> collectUsedRanges() {
+    std::vector<std::pair<size_t, size_t>> usedRanges;
+
+    for (const auto &file: fileTable) {
+      if (! file.isDirectory && file.size > 0 && file.spillState != SpillState::Spilled) {
+        usedRanges.push_back({file.offset, file.offset + file.size});
+      }
+    }
+
+    std::sort(usedRanges.begin(), usedRanges.end());
+    return usedRanges;
+  }
+
+  size_t findFile(const std::string &name, size_t parentDir) {
+    return directoryIndex.find(fileTable, name, parentDir);
+  }
+
+  size_t createFile(const std::string &name) {
+    return createFile(name, currentDir, false);
+  }
+
+  size_t createFile(const std::string &name, size_t parent, bool isDirectory) {
+    fileTable.push_back({name, 0, 0, isDirectory, parent, 0, 0, quotaRootFor(parent)});
+    fileTable.back().generation = ++fileGeneration;
+    directoryIndex.insert(fileTable, fileTable.size() - 1);
+    return fileTable.size() - 1;
+  }
+
+  size_t findDirectory(const std::string &name) {
+    if (name.empty() || name == ".") {
+      return currentDir;
+    }
+
+    size_t index = findFile(name, currentDir);
+    if (index == SIZE_MAX || ! fileTable[index].isDirectory) {
+      return SIZE_MAX;
+    }
+
+    return index;
+  }
+
+  size_t quotaRootFor(size_t dir) {
+    return fileTable[dir].quota > 0 ? dir : fileTable[dir].quotaRoot;
+  }
+
+  bool isInSubtree(size_t index, size_t dir) {
+    size_t current = index;
+    while (current != 0) {
+      current = fileTable[current].parent;
+      if (current == dir) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  size_t subtreeUsage(size_t dir) {
+    size_t total = 0;
+    for (size_t i = 0; i < fileTable.size(); i++) {
+      if (! fileTable[i].isDirectory && isInSubtree(i, dir)) {
+        total += fileTable[i].size;
+      }
+    }
+    return total;
+  }
+
+  bool chargeQuota(size_t index, size_t oldSize, size_t newSize) {
+    for (size_t r = fileTable[index].quotaRoot; r != SIZE_MAX;
+         r = fileTable[r].quotaRoot) {
+      const FileEntry &root = fileTable[r];
+      if (newSize > oldSize && root.quotaUsed - oldSize + newSize > root.quota) {
+        std::cout << "Quota exceeded for " << getFullPath(r) << " ("
+                  << formatSize(root.quotaUsed) << " of "
+                  << formatSize(root.quota) << " used)\n";
+        return false;
+      }
+    }
+
+    for (size_t r = fileTable[index].quotaRoot; r != SIZE_MAX;
+         r = fileTable[r].quotaRoot) {
+      fileTable[r].quotaUsed = fileTable[r].quotaUsed - oldSize + newSize;
+    }
+    return true;
+  }
+
+  size_t quotaHeadroom(size_t index) {
+    size_t headroom = SIZE_MAX;
+    for (size_t r = fileTable[index].quotaRoot; r != SIZE_MAX;
+         r = fileTable[r].quotaRoot) {
+      const FileEntry &root = fileTable[r];
+      headroom = (std::min)(headroom, root.quota - (std::min)(root.quota, root.quotaUsed));
+    }
+    return headroom;
+  }
+
+  void setQuota(size_t dir, size_t quota) {
+    FileEntry &entry = fileTable[dir];
+    const size_t previousRoot = quotaRootFor(dir);
+
+    entry.quota = quota;
+    entry.quotaUsed = quota > 0 ? subtreeUsage(dir) : 0;
+    const size_t newRoot = quotaRootFor(dir);
+
+    for (size_t i = 0; i < fileTable.size(); i++) {
+      if (fileTable[i].quotaRoot == previousRoot && isInSubtree(i, dir)) {
+        fileTable[i].quotaRoot = newRoot;
+      }
+    }
+  }
+
+  void removeEntry(size_t index) {
+    const size_t parent = fileTable[index].parent;
+    std::vector<size_t> remap(fileTable.size(), SIZE_MAX);
+    for (size_t i = 0; i < fileTable.size(); i++) {
+      if (i != index && ! isInSubtree(i, index)) {
+        continue;
+      }
+      FileEntry &file = fileTable[i];
+      if (! file.isDirectory) {
+        chargeQuota(i, file.size, 0);
+        if (file.spillState != SpillState::Spilled) {
+          allocator.release(file.offset, file.size);
+        }
+        dropSpillCopy(file);
+      }
+      remap[i] = SIZE_MAX - 1;
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < fileTable.size(); i++) {
+      if (remap[i] == SIZE_MAX) {
+        remap[i] = kept;
+        if (kept != i) {
+          fileTable[kept] = std::move(fileTable[i]);
+        }
+        kept++;
+      } else {
+        remap[i] = SIZE_MAX;
+      }
+    }
+    fileTable.erase(fileTable.begin() + kept, fileTable.end());
+    for (auto &entry: fileTable) {
+      entry.parent = remap[entry.parent];
+      if (entry.quotaRoot != SIZE_MAX) {
+        entry.quotaRoot = remap[entry.quotaRoot];
+      }
+    }
+    currentDir = remap[currentDir] != SIZE_MAX ? remap[currentDir] : remap[parent];
+    directoryIndex.rebuild(fileTable);
+  }
+
+  size_t usedDataEnd() {
+    size_t usedEnd = dataStart;
+    for (const auto &range: collectUsedRanges()) {
+      usedEnd = (std::max)(usedEnd, range.second);
+    }
+    return usedEnd;
+  }
+
+  bool resizeArena(size_t newSize) {
+    if (newSize < usedDataEnd() || ! reallocateMemory(newSize)) {
+      return false;
+    }
+    allocator.resize(memorySize);
+    return true;
+  }
+
+  size_t allocateWithGrowth(size_t size, size_t alignment) {
+    size_t offset = allocator.allocate(size, alignment);
+    while (offset == SIZE_MAX && autogrow.enabled && memorySize < autogrow.cap) {
+      const size_t grown = (std::max)(static_cast<size_t>(memorySize * autogrow.factor),
+                                      memorySize + size);
+      if (! resizeArena((std::min)(autogrow.cap, grown))) {
+        break;
+      }
+      if (announceGrowth) {
+        std::cout << "Arena grew to " << formatSize(memorySize) << "\n";
+      }
+      offset = allocator.allocate(size, alignment);
+    }
+    return offset;
+  }
+
+  void maybeShrinkArena() {
+    if (! autogrow.enabled || autogrow.lowWater <= 0 || memorySize <= autogrow.floor) {
+      return;
+    }
+
+    const size_t capacity = memorySize - dataStart;
+    const size_t used = capacity - (std::min)(capacity, allocator.freeBytes());
+    if (used >= autogrow.lowWater * capacity) {
+      return;
+    }
+
+    const size_t target = (std::max)({autogrow.floor, usedDataEnd(),
+                                      static_cast<size_t>(memorySize / autogrow.factor)});
+    if (target < memorySize && resizeArena(target)) {
+      std::cout << "Arena shrank to " << formatSize(memorySize) << "\n";
+    }
+  }
+
+  void dropSpillCopy(FileEntry &file) {
+    file.generation = ++fileGeneration;
+    if (file.spillOffset != SIZE_MAX) {
+      spill.release(file.spillOffset, file.size);
+      file.spillOffset = SIZE_MAX;
+    }
+    file.spillState = SpillState::Resident;
+  }
+
+  void invalidateHostCopies(size_t offset, size_t length) {
+    spill.drain();
+    for (auto &file: fileTable) {
+      if (! file.isDirectory && file.spillState != SpillState::Spilled && file.size > 0 &&
+          file.offset < offset + length && offset < file.offset + file.size) {
+        dropSpillCopy(file);
+        file.hostStamp = 0;
+      }
+    }
+  }
+
+  bool demoteFile(size_t index) {
+    FileEntry &file = fileTable[index];
+    if (file.isDirectory || file.size == 0 || file.spillState == SpillState::Spilled) {
+      return false;
+    }
+
+    if (file.spillState == SpillState::Resident) {
+      const size_t spillOffset = spill.allocate(file.size);
+      if (spillOffset == SIZE_MAX || ! spill.write(spillOffset, memory + file.offset, file.size)) {
+        if (spillOffset != SIZE_MAX) {
+          spill.release(spillOffset, file.size);
+        }
+        return false;
+      }
+      file.spillOffset = spillOffset;
+      spillStats.bytesOut += file.size;
+    } else {
+      spill.wait(file.spillOffset);
+    }
+
+    allocator.release(file.offset, file.size);
+    file.spillState = SpillState::Spilled;
+    file.generation = ++fileGeneration;
+    spillStats.demotions++;
+    return true;
+  }
+
+  size_t evictColdFiles(size_t size, size_t alignment, size_t exclude) {
+    std::vector<size_t> candidates;
+    for (size_t i = 0; i < fileTable.size(); i++) {
+      const FileEntry &file = fileTable[i];
+      if (i != exclude && ! file.isDirectory && file.size > 0 &&
+          file.spillState != SpillState::Spilled) {
+        candidates.push_back(i);
+      }
+    }
+    std::sort(candidates.begin(), candidates.end(), [&](size_t a, size_t b) {
+      return fileTable[a].lastAccess < fileTable[b].lastAccess;
+    });
+
+    for (size_t index: candidates) {
+      if (demoteFile(index)) {
+        const size_t offset = allocator.allocate(size, alignment);
+        if (offset != SIZE_MAX) {
+          return offset;
+        }
+      }
+    }
+    return SIZE_MAX;
+  }
+
+  size_t alignmentFor(size_t index) {
+    return fileTable[index].alignment > 0 ? fileTable[index].alignment : defaultAlignment;
+  }
+
+  size_t allocateResident(size_t size, size_t index) {
+    const size_t alignment = alignmentFor(index);
+    size_t offset = allocateWithGrowth(size, alignment);
+    if (offset == SIZE_MAX && spill.isOpen() && size <= memorySize - dataStart) {
+      offset = evictColdFiles(size, alignment, index);
+    }
+    return offset;
+  }
+
+  static size_t parseAlignment(const std::string &name) {
+    if (name == "none") return 1;
+    if (name == "cacheline") return 64;
+    if (name == "4k") return 4096;
+    if (name == "2m") return largestAlignment;
+    return 0;
+  }
+
+  static const char *alignmentName(size_t alignment) {
+    switch (alignment) {
+      case 64: return "cacheline";
+      case 4096: return "4k";
+      case largestAlignment: return "2m";
+      default: return "none";
+    }
+  }
+
+  bool relocateFile(size_t index) {
+    FileEntry &file = fileTable[index];
+    if (file.isDirectory || file.size == 0 || file.spillState == SpillState::Spilled ||
+        file.offset % alignmentFor(index) == 0) {
+      return true;
+    }
+
+    const size_t oldOffset = file.offset;
+    allocator.release(oldOffset, file.size);
+    const size_t offset = allocateResident(file.size, index);
+    if (offset == SIZE_MAX) {
+      allocator.reserve(oldOffset, file.size);
+      return false;
+    }
+
+    std::memmove(memory + offset, memory + oldOffset, file.size);
+    markDirty(offset, file.size);
+    dropSpillCopy(file);
+    file.offset = offset;
+    return true;
+  }
+
+  void writeOutput(const uint8_t *data, size_t size) {
+    static const HANDLE output = GetStdHandle(STD_OUTPUT_HANDLE);
+    static const DWORD outputType = GetFileType(output);
+    if (outputSuppressed || (outputType != FILE_TYPE_PIPE && outputType != FILE_TYPE_DISK)) {
+      std::cout.write(reinterpret_cast<const char *>(data), size);
+      return;
+    }
+
+    std::cout.flush();
+    if (! writeAll(output, data, size)) {
+      std::cout.setstate(std::ios::badbit);
+    }
+  }
+
+  size_t readInput(uint8_t *data, size_t size) {
+    if (! inputCarry.empty()) {
+      const size_t count = (std::min)(size, inputCarry.size());
+      std::copy_n(inputCarry.begin(), count, data);
+      inputCarry.erase(inputCarry.begin(), inputCarry.begin() + count);
+      return count;
+    }
+
+    static const HANDLE input = GetStdHandle(STD_INPUT_HANDLE);
+    DWORD read = 0;
+    const DWORD chunk = static_cast<DWORD>((std::min)(size, static_cast<size_t>(1) << 30));
+    if (! ReadFile(input, data, chunk, &read, nullptr)) {
+      return 0;
+    }
+    return read;
+  }
+
+  bool resizeKeepingData(size_t index, size_t newSize, size_t keep) {
+    const size_t oldOffset = fileTable[index].offset;
+    if (! allocateFile(index, newSize)) {
+      return false;
+    }
+    if (fileTable[index].offset != oldOffset && keep > 0) {
+      std::memmove(memory + fileTable[index].offset, memory + oldOffset, keep);
+      markDirty(fileTable[index].offset, keep);
+    }
+    return true;
+  }
+
+  size_t growStream(size_t index, size_t capacity, size_t size) {
+    NullBuffer nullBuffer;
+    std::streambuf *original = std::cout.rdbuf(&nullBuffer);
+    size_t step = (std::min)((std::max)(capacity, trackedPageSize), quotaHeadroom(index));
+    size_t grown = capacity;
+    while (step > 0) {
+      if (resizeKeepingData(index, capacity + step, size)) {
+        grown = capacity + step;
+        break;
+      }
+      step = step > trackedPageSize ? step / 2 : 0;
+    }
+    std::cout.rdbuf(original);
+    return grown;
+  }
+
+  // Drains the rest of an oversized stream so it is not run as commands.
+  size_t discardInput(const std::string &terminator, std::string line) {
+    std::vector<uint8_t> buffer(static_cast<size_t>(64) << 10);
+    const size_t keep = terminator.size() + 2;
+    size_t discarded = 0;
+    while (const size_t read = readInput(buffer.data(), buffer.size())) {
+      size_t scan = 0;
+      while (! terminator.empty() && scan < read) {
+        const void *found = std::memchr(buffer.data() + scan, '\n', read - scan);
+        const size_t stop = found ? static_cast<const uint8_t *>(found) - buffer.data() : read;
+        line.append(reinterpret_cast<const char *>(buffer.data() + scan),
+                    (std::min)(stop - scan, keep - (std::min)(keep, line.size())));
+        if (! found) {
+          break;
+        }
+        if (! line.empty() && line.back() == '\r') {
+          line.pop_back();
+        }
+        if (line == terminator) {
+          inputCarry.insert(inputCarry.begin(), buffer.data() + stop + 1, buffer.data() + read);
+          return discarded + stop + 1;
+        }
+        line.clear();
+        scan = stop + 1;
+      }
+      discarded += read;
+    }
+    return discarded;
+  }
+
+  void streamInput(size_t index, size_t length, const std::string &terminator) {
+    const bool exact = length != SIZE_MAX;
+    const size_t initial = static_cast<size_t>(1) << 20;
+    size_t capacity = exact ? length
+                            : (std::min)(initial, fileTable[index].size + (std::min)(initial, quotaHeadroom(index)));
+    if (! resizeKeepingData(index, capacity, 0)) {
+      return;
+    }
+
+    size_t size = 0;
+    size_t lineStart = 0;
+    bool terminated = false;
+    bool truncated = false;
+    size_t dropped = 0;
+    while (! terminated && (! exact || size < length)) {
+      if (size == capacity) {
+        const size_t grown = growStream(index, capacity, size);
+        if (grown == capacity) {
+          const uint8_t *base = memory + fileTable[index].offset;
+          dropped = discardInput(terminator, std::string(base + lineStart, base + size));
+          truncated = true;
+          break;
+        }
+        capacity = grown;
+      }
+
+      uint8_t *base = memory + fileTable[index].offset;
+      const size_t read = readInput(base + size, capacity - size);
+      if (read == 0) {
+        break;
+      }
+      if (terminator.empty()) {
+        size += read;
+        continue;
+      }
+
+      const size_t end = size + read;
+      size_t scan = size;
+      while (const void *found = std::memchr(base + scan, '\n', end - scan)) {
+        const size_t newline = static_cast<const uint8_t *>(found) - base;
+        size_t lineEnd = newline;
+        if (lineEnd > lineStart && base[lineEnd - 1] == '\r') {
+          lineEnd--;
+        }
+        if (lineEnd - lineStart == terminator.size() &&
+            std::equal(terminator.begin(), terminator.end(), base + lineStart)) {
+          inputCarry.insert(inputCarry.begin(), base + newline + 1, base + end);
+          terminated = true;
+          break;
+        }
+        lineStart = newline + 1;
+        scan = lineStart;
+      }
+      size = terminated ? lineStart : end;
+    }
+
+    if (size != capacity) {
+      resizeKeepingData(index, size, size);
+    }
+    FileEntry &file = fileTable[index];
+    file.lastAccess = accessClock;
+    recordAccess(file.offset, file.size);
+    markDirty(file.offset, file.size);
+
+    std::cout << "Read " << formatSize(file.size) << " into " << file.name;
+    if (truncated) {
+      std::cout << " (truncated: no " << (quotaHeadroom(index) == 0 ? "quota" : "arena space")
+                << " left to grow it; dropped " << formatSize(dropped) << " more input)";
+    } else if (exact && size < length) {
+      std::cout << " (input ended " << formatSize(length - size) << " short)";
+    } else if (! terminator.empty() && ! terminated) {
+      std::cout << " (no " << terminator << " terminator before end of input)";
+    }
+    std::cout << "\n";
+  }
+
+  struct ArenaRange {
+    size_t offset = 0;
+    size_t length = 0;
+    size_t file = SIZE_MAX;
+  };
+
+  bool resolveRange(const std::string &spec, ArenaRange &range) {
+    if (! spec.empty() && spec[0] == '@') {
+      const size_t colon = spec.find(':');
+      try {
+        range.offset = std::stoull(spec.substr(1, colon - 1));
+        range.length = colon == std::string::npos ? 0 : std::stoull(spec.substr(colon + 1));
+      } catch (const std::exception &) {
+        std::cout << "Ranges are written @offset:length\n";
+        return false;
+      }
+      if (colon == std::string::npos || range.offset > memorySize ||
+          range.length > memorySize - range.offset) {
+        std::cout << "Range " << spec << " is outside the arena\n";
+        return false;
+      }
+      range.file = SIZE_MAX;
+      return true;
+    }
+
+    range.file = findFile(spec, currentDir);
+    if (range.file == SIZE_MAX || fileTable[range.file].isDirectory) {
+      std::cout << "File not found: " << spec << "\n";
+      return false;
+    }
+    if (! faultIn(range.file)) {
+      std::cout << "Not enough arena space to load " << spec << "\n";
+      return false;
+    }
+    FileEntry &file = fileTable[range.file];
+    file.lastAccess = accessClock;
+    range.offset = file.offset;
+    range.length = file.size;
+    return true;
+  }
+
+  static bool rangesOverlap(const ArenaRange &range, size_t offset, size_t length) {
+    return offset < range.offset + range.length && range.offset < offset + length;
+  }
+
+  bool prepareDestination(const std::string &spec, size_t length, ArenaRange &source,
+                          ArenaRange &destination) {
+    if (! spec.empty() && spec[0] == '@') {
+      if (! resolveRange(spec + ":" + std::to_string(length), destination)) {
+        return false;
+      }
+      if (rangesOverlap(source, destination.offset, length)) {
+        std::cout << "Source and destination ranges overlap\n";
+        return false;
+      }
+      invalidateHostCopies(destination.offset, length);
+      return true;
+    }
+
+    destination.file = findFile(spec, currentDir);
+    if (destination.file == SIZE_MAX) {
+      destination.file = createFile(spec);
+    } else if (fileTable[destination.file].isDirectory || destination.file == source.file) {
+      std::cout << "Destination must be a file other than the source\n";
+      return false;
+    }
+    if (! allocateFile(destination.file, length)) {
+      return false;
+    }
+    fileTable[destination.file].lastAccess = accessClock;
+
+    if (source.file != SIZE_MAX &&
+        (! faultIn(source.file) ||
+         fileTable[destination.file].spillState == SpillState::Spilled)) {
+      std::cout << "Not enough arena space for both source and destination\n";
+      return false;
+    }
+    if (source.file != SIZE_MAX) {
+      source.offset = fileTable[source.file].offset;
+    }
+    destination.offset = fileTable[destination.file].offset;
+    destination.length = length;
+    return true;
+  }
+
+  void runCodec(const std::string &codec, const std::string &sourceSpec,
+                const std::string &destinationSpec) {
+    ArenaRange source;
+    ArenaRange destination;
+    if (! resolveRange(sourceSpec, source)) {
+      return;
+    }
+
+    const bool hex = codec.compare(0, 3, "hex") == 0;
+    const bool encode = codec.compare(codec.size() - 3, 3, "enc") == 0;
+    size_t inputLength = source.length;
+    size_t outputLength = 0;
+    if (encode) {
+      outputLength = hex ? inputLength * 2 : (inputLength + 2) / 3 * 4;
+    } else {
+      const uint8_t *input = memory + source.offset;
+      while (inputLength > 0 && std::isspace(input[inputLength - 1])) {
+        inputLength--;
+      }
+      for (int padding = 0; ! hex && padding < 2 && inputLength > 0 &&
+                            input[inputLength - 1] == '='; padding++) {
+        inputLength--;
+      }
+      if (hex ? inputLength % 2 != 0 : inputLength % 4 == 1) {
+        std::cout << "Input length " << inputLength << " is not valid " << (hex ? "hex" : "base64")
+                  << "\n";
+        return;
+      }
+      outputLength = hex ? inputLength / 2 : inputLength / 4 * 3 + (inputLength % 4 ? inputLength % 4 - 1 : 0);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    if (! encode) {
+      const uint8_t *input = memory + source.offset;
+      const size_t invalid = hex ? hexFindInvalid(input, inputLength) : base64FindInvalid(input, inputLength);
+      if (invalid != SIZE_MAX) {
+        std::cout << "Invalid character at input offset " << invalid << "\n";
+        return;
+      }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (! prepareDestination(destinationSpec, outputLength, source, destination)) {
+      return;
+    }
+
+    std::vector<uint8_t> scratch;
+    const uint8_t *input = memory + source.offset;
+    if (source.file == SIZE_MAX && rangesOverlap(source, destination.offset, outputLength)) {
+      scratch.assign(input, input + inputLength);
+      input = scratch.data();
+    }
+    uint8_t *output = memory + destination.offset;
+    start = std::chrono::steady_clock::now();
+    if (encode) {
+      hex ? hexEncode(input, inputLength, output) : base64Encode(input, inputLength, output);
+    } else {
+      hex ? hexDecode(input, inputLength, output) : base64Decode(input, inputLength, output);
+    }
+    seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    recordAccess(source.offset, inputLength);
+    recordAccess(destination.offset, outputLength);
+    markDirty(destination.offset, outputLength);
+    std::cout << formatSize(inputLength) << " -> " << formatSize(outputLength) << " in "
+              << formatDuration(seconds) << " ("
+              << formatSize(static_cast<size_t>(inputLength / (std::max)(seconds, 1e-9))) << "/s)\n";
+  }
+
+  void transferRange(const std::string &hostPath, size_t offset, size_t length, size_t threads,
+                     bool toHost) {
+    auto start = std::chrono::steady_clock::now();
+    if (toHost) {
+      HANDLE handle = CreateFileA(hostPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                                  FILE_ATTRIBUTE_NORMAL, nullptr);
+      if (handle == INVALID_HANDLE_VALUE) {
+        std::cout << "Could not create " << hostPath << "\n";
+        return;
+      }
+      LARGE_INTEGER end;
+      end.QuadPart = static_cast<LONGLONG>(length);
+      const bool sized = SetFilePointerEx(handle, end, nullptr, FILE_BEGIN) && SetEndOfFile(handle);
+      CloseHandle(handle);
+      if (! sized) {
+        std::cout << "Could not size " << hostPath << " to " << formatSize(length) << "\n";
+        return;
+      }
+    } else {
+      invalidateHostCopies(offset, length);
+    }
+
+    const size_t sliceAlignment = static_cast<size_t>(1) << 20;
+    const size_t slice = alignUp((std::max)((length + threads - 1) / threads, static_cast<size_t>(1)),
+                                 sliceAlignment);
+    std::atomic<bool> ok{true};
+    auto worker = [&](size_t begin) {
+      const size_t count = (std::min)(slice, length - begin);
+      HANDLE handle = CreateFileA(hostPath.c_str(), toHost ? GENERIC_WRITE : GENERIC_READ,
+                                  FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING,
+                                  FILE_ATTRIBUTE_NORMAL, nullptr);
+      if (handle == INVALID_HANDLE_VALUE ||
+          ! (toHost ? writeFileAt(handle, begin, memory + offset + begin, count)
+                    : readFileAt(handle, begin, memory + offset + begin, count))) {
+        ok = false;
+      }
+      if (handle != INVALID_HANDLE_VALUE) {
+        CloseHandle(handle);
+      }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t begin = slice; begin < length; begin += slice) {
+      workers.emplace_back(worker, begin);
+    }
+    worker(0);
+    for (auto &thread: workers) {
+      thread.join();
+    }
+    recordAccess(offset, length);
+    if (! toHost) {
+      markDirty(offset, length);
+    }
+
+    if (! ok) {
+      std::cout << (toHost ? "Dump to " : "Load from ") << hostPath << " failed\n";
+      return;
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << (toHost ? "Dumped " : "Loaded ") << formatSize(length) << (toHost ? " to " : " from ")
+              << hostPath << " in " << formatDuration(seconds) << " ("
+              << formatSize(static_cast<size_t>(length / (std::max)(seconds, 1e-9))) << "/s, "
+              << workers.size() + 1 << (workers.empty() ? " stream" : " streams") << ")\n";
+  }
+
+  struct SyncStats {
+    size_t files = 0;
+    size_t unchanged = 0;
+    size_t created = 0;
+    size_t updated = 0;
+    size_t failed = 0;
+    size_t bytesCompared = 0;
+    size_t bytesWritten = 0;
+    size_t maxThreads = 1;
+  };
+
+  // Only blocks that differ are written, so unchanged pages stay clean.
+  void syncFile(const std::string &hostPath, size_t index, size_t hostSize, uint64_t stamp,
+                bool compareAll, SyncStats &stats) {
+    stats.files++;
+    FileEntry &file = fileTable[index];
+    if (! compareAll && file.size == hostSize && file.hostStamp == stamp && stamp != 0) {
+      stats.unchanged++;
+      return;
+    }
+
+    size_t keep = (std::min)(file.size, hostSize);
+    if (file.spillState == SpillState::Spilled) {
+      keep = 0;
+      if (! allocateFile(index, hostSize)) {
+        stats.failed++;
+        return;
+      }
+    } else if (file.size != hostSize && ! resizeKeepingData(index, hostSize, keep)) {
+      stats.failed++;
+      return;
+    }
+
+    const size_t blockSize = trackedPageSize;
+    const size_t chunkSize = static_cast<size_t>(4) << 20;
+    const size_t chunks = (hostSize + chunkSize - 1) / chunkSize;
+    const size_t threads = (std::max)(static_cast<size_t>(1),
+                                      (std::min)(static_cast<size_t>(std::thread::hardware_concurrency()),
+                                                 chunks));
+    uint8_t *extent = memory + file.offset;
+    std::vector<std::vector<std::pair<size_t, size_t>>> written(threads);
+    std::atomic<size_t> nextChunk{0};
+    std::atomic<bool> ok{true};
+    auto worker = [&](size_t thread) {
+      HANDLE handle = CreateFileA(hostPath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                  FILE_ATTRIBUTE_NORMAL, nullptr);
+      if (handle == INVALID_HANDLE_VALUE) {
+        ok = false;
+        return;
+      }
+      std::vector<uint8_t> buffer((std::min)(chunkSize, hostSize));
+      for (size_t chunk = nextChunk++; ok && chunk < chunks; chunk = nextChunk++) {
+        const size_t begin = chunk * chunkSize;
+        const size_t length = (std::min)(chunkSize, hostSize - begin);
+        if (! readFileAt(handle, begin, buffer.data(), length)) {
+          ok = false;
+          break;
+        }
+        for (size_t block = 0; block < length; block += blockSize) {
+          const size_t offset = begin + block;
+          const size_t size = (std::min)(blockSize, length - block);
+          if (offset + size <= keep && std::memcmp(extent + offset, buffer.data() + block, size) == 0) {
+            continue;
+          }
+          std::memcpy(extent + offset, buffer.data() + block, size);
+          auto &runs = written[thread];
+          if (! runs.empty() && runs.back().first + runs.back().second == offset) {
+            runs.back().second += size;
+          } else {
+            runs.push_back({offset, size});
+          }
+        }
+      }
+      CloseHandle(handle);
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t thread = 1; thread < threads; thread++) {
+      workers.emplace_back(worker, thread);
+    }
+    worker(0);
+    for (auto &thread: workers) {
+      thread.join();
+    }
+
+    size_t changed = 0;
+    for (const auto &runs: written) {
+      for (const auto &run: runs) {
+        markDirty(file.offset + run.first, run.second);
+        recordAccess(file.offset + run.first, run.second);
+        changed += run.second;
+      }
+    }
+    if (changed > 0) {
+      dropSpillCopy(file);
+    }
+    file.lastAccess = accessClock;
+    stats.bytesCompared += keep;
+    stats.bytesWritten += changed;
+    stats.maxThreads = (std::max)(stats.maxThreads, threads);
+    if (! ok) {
+      std::cout << "Could not read " << hostPath << "\n";
+      file.hostStamp = 0;
+      stats.failed++;
+      return;
+    }
+    file.hostStamp = stamp;
+    if (changed > 0 || file.size != keep) {
+      stats.updated++;
+    }
+  }
+
+  void syncDirectory(const std::string &hostDir, size_t dir, bool compareAll, SyncStats &stats) {
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA((hostDir + "\\*").c_str(), &data);
+    if (find == INVALID_HANDLE_VALUE) {
+      std::cout << "Could not list " << hostDir << "\n";
+      stats.failed++;
+      return;
+    }
+
+    do {
+      const std::string name = data.cFileName;
+      if (name == "." || name == "..") {
+        continue;
+      }
+      const std::string hostPath = hostDir + "\\" + name;
+      const bool isDirectory = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+      size_t index = findFile(name, dir);
+      if (index != SIZE_MAX && fileTable[index].isDirectory != isDirectory) {
+        std::cout << "Skipping " << hostPath << ": " << getFullPath(index) << " is a "
+                  << (isDirectory ? "file" : "directory") << "\n";
+        stats.failed++;
+        continue;
+      }
+      if (index == SIZE_MAX) {
+        index = createFile(name, dir, isDirectory);
+        stats.created += isDirectory ? 0 : 1;
+      }
+
+      if (isDirectory) {
+        syncDirectory(hostPath, index, compareAll, stats);
+      } else {
+        const size_t size = static_cast<size_t>(data.nFileSizeHigh) << 32 | data.nFileSizeLow;
+        const uint64_t stamp = static_cast<uint64_t>(data.ftLastWriteTime.dwHighDateTime) << 32 |
+                               data.ftLastWriteTime.dwLowDateTime;
+        syncFile(hostPath, index, size, stamp, compareAll, stats);
+      }
+    } while (FindNextFileA(find, &data));
+    FindClose(find);
+  }
+
+  void syncFromHost(const std::string &hostDir, const std::string &target, bool compareAll) {
+    auto start = std::chrono::steady_clock::now();
+    size_t dir = findDirectory(target);
+    if (dir == SIZE_MAX) {
+      if (findFile(target, currentDir) != SIZE_MAX) {
+        std::cout << target << " is not a directory\n";
+        return;
+      }
+      dir = createFile(target, currentDir, true);
+    }
+
+    SyncStats stats;
+    syncDirectory(hostDir, dir, compareAll, stats);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Synced " << stats.files << (stats.files == 1 ? " file" : " files") << " into "
+              << getFullPath(dir) << ": " << stats.created << " new, " << stats.updated << " updated, "
+              << stats.unchanged << " skipped by size/time";
+    if (stats.failed > 0) {
+      std::cout << ", " << stats.failed << " failed";
+    }
+    std::cout << "\nWrote " << formatSize(stats.bytesWritten) << " after comparing "
+              << formatSize(stats.bytesCompared) << " in place, in " << formatDuration(seconds) << " (up to "
+              << stats.maxThreads << (stats.maxThreads == 1 ? " thread" : " threads") << ")\n";
+  }
+
+  template <typename T>
+  void peekValues(size_t offset, size_t count, bool bigEndian) {
+    if (offset > memorySize || count > (memorySize - offset) / sizeof(T)) {
+      std::cout << "Invalid offset\n";
+      return;
+    }
+
+    const size_t perLine = 32 / sizeof(T);
+    const size_t chunk = static_cast<size_t>(64) << 10;
+    std::string text;
+    text.reserve(chunk + 1024);
+    char buffer[64];
+    for (size_t i = 0; i < count; i++) {
+      if (i % perLine == 0) {
+        if (text.size() >= chunk) {
+          writeOutput(reinterpret_cast<const uint8_t *>(text.data()), text.size());
+          text.clear();
+        }
+        const auto line = std::to_chars(buffer, buffer + sizeof(buffer), offset + i * sizeof(T));
+        text.append(i == 0 ? "" : "\n").append(buffer, line.ptr).append(":");
+      }
+      T value;
+      std::memcpy(&value, memory + offset + i * sizeof(T), sizeof(T));
+      if (bigEndian) {
+        value = byteSwap(value);
+      }
+      const auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+      text.append(" ").append(buffer, result.ptr);
+    }
+    text.append("\n");
+    writeOutput(reinterpret_cast<const uint8_t *>(text.data()), text.size());
+    recordAccess(offset, count * sizeof(T));
+  }
+
+  template <typename T>
+  void pokeValues(size_t offset, const std::string &text, bool bigEndian) {
+    std::vector<T> values;
+    const char *cursor = text.data();
+    const char *end = text.data() + text.size();
+    while (true) {
+      while (cursor < end && (*cursor == ' ' || *cursor == ',' || *cursor == '\t')) {
+        cursor++;
+      }
+      if (cursor == end) {
+        break;
+      }
+      T value;
+      const auto result = std::from_chars(cursor, end, value);
+      if (result.ec != std::errc() ||
+          (result.ptr < end && *result.ptr != ' ' && *result.ptr != ',' && *result.ptr != '\t')) {
+        std::cout << "Invalid value at: " << std::string(cursor, std::find(cursor, end, ' ')) << "\n";
+        return;
+      }
+      values.push_back(bigEndian ? byteSwap(value) : value);
+      cursor = result.ptr;
+    }
+
+    if (values.empty() || offset > memorySize ||
+        values.size() > (memorySize - offset) / sizeof(T)) {
+      std::cout << (values.empty() ? "No values given\n" : "Invalid offset\n");
+      return;
+    }
+    invalidateHostCopies(offset, values.size() * sizeof(T));
+    std::memcpy(memory + offset, values.data(), values.size() * sizeof(T));
+    markDirty(offset, values.size() * sizeof(T));
+    recordAccess(offset, values.size() * sizeof(T));
+    std::cout << "Written " << values.size() << (values.size() == 1 ? " value" : " values")
+              << " at offset " << offset << "\n";
+  }
+
+  std::array<uint64_t, 256> profileRange(const ArenaRange &range, size_t blockSize,
+                                         std::vector<double> *blockEntropy, size_t &threadsUsed) {
+    const size_t blocks = (range.length + blockSize - 1) / blockSize;
+    const size_t minimumPerThread = (std::max)(static_cast<size_t>(1),
+                                               (static_cast<size_t>(4) << 20) / blockSize);
+    threadsUsed = (std::max)(static_cast<size_t>(1),
+                             (std::min)(static_cast<size_t>(std::thread::hardware_concurrency()),
+                                        blocks / minimumPerThread));
+    if (blockEntropy != nullptr) {
+      blockEntropy->assign(blocks, 0);
+    }
+
+    std::vector<std::array<uint64_t, 256>> partial(threadsUsed);
+    auto worker = [&](size_t thread) {
+      std::array<uint64_t, 256> &total = partial[thread];
+      total.fill(0);
+      for (size_t block = thread * blocks / threadsUsed; block < (thread + 1) * blocks / threadsUsed;
+           block++) {
+        const size_t begin = block * blockSize;
+        const size_t size = (std::min)(blockSize, range.length - begin);
+        uint64_t counts[256] = {};
+        countBytes(memory + range.offset + begin, size, counts);
+        for (size_t value = 0; value < 256; value++) {
+          total[value] += counts[value];
+        }
+        if (blockEntropy != nullptr) {
+          (*blockEntropy)[block] = shannonEntropy(counts, size);
+        }
+      }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t thread = 1; thread < threadsUsed; thread++) {
+      workers.emplace_back(worker, thread);
+    }
+    worker(0);
+    for (auto &thread: workers) {
+      thread.join();
+    }
+
+    std::array<uint64_t, 256> counts = {};
+    for (const auto &part: partial) {
+      for (size_t value = 0; value < 256; value++) {
+        counts[value] += part[value];
+      }
+    }
+    recordAccess(range.offset, range.length);
+    return counts;
+  }
+
+  void displayHistogram(const ArenaRange &range) {
+    auto start = std::chrono::steady_clock::now();
+    size_t threads = 0;
+    const auto counts = profileRange(range, static_cast<size_t>(1) << 20, nullptr, threads);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<size_t> order;
+    for (size_t value = 0; value < 256; value++) {
+      if (counts[value] > 0) {
+        order.push_back(value);
+      }
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return counts[a] > counts[b]; });
+
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(3);
+    out << formatSize(range.length) << ", " << order.size() << " distinct byte values, entropy "
+        << shannonEntropy(counts.data(), range.length) << " bits/byte\n";
+    for (size_t i = 0; i < order.size() && i < 16; i++) {
+      out << "  0x" << std::hex << std::setw(2) << std::setfill('0') << order[i] << std::dec
+          << std::setfill(' ') << std::setw(14) << counts[order[i]] << std::setw(9)
+          << 100.0 * counts[order[i]] / range.length << "%\n";
+    }
+    std::cout << out.str() << "Scanned in " << formatDuration(seconds) << " ("
+              << formatSize(static_cast<size_t>(range.length / (std::max)(seconds, 1e-9))) << "/s, "
+              << threads << (threads == 1 ? " thread" : " threads") << ")\n";
+  }
+
+  void displayEntropy(const ArenaRange &range, size_t blockSize) {
+    auto start = std::chrono::steady_clock::now();
+    size_t threads = 0;
+    std::vector<double> blocks;
+    const auto counts = profileRange(range, blockSize, &blocks, threads);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::array<size_t, 8> buckets = {};
+    for (double entropy: blocks) {
+      buckets[(std::min)(static_cast<size_t>(entropy), buckets.size() - 1)]++;
+    }
+
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(3);
+    out << "Entropy " << shannonEntropy(counts.data(), range.length) << " bits/byte over "
+        << blocks.size() << " blocks of " << formatSize(blockSize);
+    if (! blocks.empty()) {
+      out << " (min " << *std::min_element(blocks.begin(), blocks.end()) << ", max "
+          << *std::max_element(blocks.begin(), blocks.end()) << ")";
+    }
+    out << "\n";
+    if (blocks.size() <= 32) {
+      for (size_t block = 0; block < blocks.size(); block++) {
+        out << std::setw(14) << range.offset + block * blockSize << "  " << blocks[block] << "\n";
+      }
+    } else {
+      for (size_t bucket = 0; bucket < buckets.size(); bucket++) {
+        out << "  " << bucket << "-" << bucket + 1 << " bits: " << std::setw(10) << buckets[bucket]
+            << " blocks\n";
+      }
+    }
+    std::cout << out.str() << "Scanned in " << formatDuration(seconds) << " ("
+              << formatSize(static_cast<size_t>(range.length / (std::max)(seconds, 1e-9))) << "/s, "
+              << threads << (threads == 1 ? " thread" : " threads") << ")\n";
+  }
+
+  struct ImageMetadata {
+    size_t memorySize = 0;
+    size_t dataStart = 0;
+    size_t currentDir = 0;
+    size_t defaultAlignment = 1;
+    std::vector<FileEntry> files;
+    Allocator layout;
+  };
+
+  static constexpr char imageMagic[8] = {'M', 'E', 'M', 'S', 'H', 'E', 'L', 'L'};
+  static constexpr size_t imagePageSize = 4096;
+
+  static void appendEntry(std::string &out, const FileEntry &file) {
+    appendU64(out, file.name.size());
+    out += file.name;
+    for (size_t field: {file.offset, file.size, static_cast<size_t>(file.isDirectory), file.parent,
+                        file.quota, file.quotaUsed, file.quotaRoot, file.alignment}) {
+      appendU64(out, field);
+    }
+  }
+
+  static bool readEntry(const uint8_t *&cursor, const uint8_t *end, FileEntry &file) {
+    uint64_t nameLength = 0;
+    uint64_t isDirectory = 0;
+    if (! readU64(cursor, end, nameLength) || nameLength > static_cast<uint64_t>(end - cursor)) {
+      return false;
+    }
+    file.name.assign(reinterpret_cast<const char *>(cursor), nameLength);
+    cursor += nameLength;
+    for (size_t *field: {&file.offset, &file.size, &isDirectory, &file.parent, &file.quota,
+                         &file.quotaUsed, &file.quotaRoot, &file.alignment}) {
+      if (! readU64(cursor, end, *field)) {
+        return false;
+      }
+    }
+    file.isDirectory = isDirectory != 0;
+    return true;
+  }
+
+  std::string serializeMetadata() {
+    std::string out;
+    appendU64(out, memorySize);
+    appendU64(out, dataStart);
+    appendU64(out, currentDir);
+    appendU64(out, defaultAlignment);
+    appendU64(out, fileTable.size());
+    for (const auto &file: fileTable) {
+      appendEntry(out, file);
+    }
+    return out;
+  }
+
+  static bool isAlignmentClass(size_t alignment) {
+    return alignment == 1 || alignment == 64 || alignment == 4096 || alignment == largestAlignment;
+  }
+
+  static bool validEntry(const std::vector<FileEntry> &files, size_t index, size_t dataStart, size_t memorySize) {
+    const FileEntry &file = files[index];
+    if (file.parent >= files.size() || ! files[file.parent].isDirectory ||
+        (file.quotaRoot != SIZE_MAX &&
+         (file.quotaRoot >= files.size() || ! files[file.quotaRoot].isDirectory || files[file.quotaRoot].quota == 0)) ||
+        (file.alignment != 0 && ! isAlignmentClass(file.alignment))) {
+      return false;
+    }
+    if (file.isDirectory || file.size == 0 || file.spillState == SpillState::Spilled) {
+      return true;
+    }
+    return file.offset >= dataStart && file.offset <= memorySize && file.size <= memorySize - file.offset &&
+           (file.alignment == 0 || file.offset % file.alignment == 0);
+  }
+
+  static bool linksTerminate(const std::vector<FileEntry> &files) {
+    auto terminates = [&](auto next) {
+      std::vector<uint8_t> state(files.size(), 0);
+      for (size_t i = 0; i < files.size(); i++) {
+        size_t current = i;
+        while (current != SIZE_MAX && state[current] == 0) {
+          state[current] = 1;
+          current = next(current);
+        }
+        if (current != SIZE_MAX && state[current] == 1) {
+          return false;
+        }
+        for (current = i; current != SIZE_MAX && state[current] == 1; current = next(current)) {
+          state[current] = 2;
+        }
+      }
+      return true;
+    };
+    return terminates([&](size_t i) { return i == 0 ? SIZE_MAX : files[i].parent; }) &&
+           terminates([&](size_t i) { return files[i].quotaRoot; });
+  }
+
+  static bool deserializeMetadata(const uint8_t *cursor, const uint8_t *end, ImageMetadata &image) {
+    uint64_t count = 0;
+    if (! readU64(cursor, end, image.memorySize) || ! readU64(cursor, end, image.dataStart) ||
+        ! readU64(cursor, end, image.currentDir) || ! readU64(cursor, end, image.defaultAlignment) ||
+        ! readU64(cursor, end, count) || count == 0 || count > static_cast<uint64_t>(end - cursor)) {
+      return false;
+    }
+
+    image.files.resize(count);
+    for (auto &file: image.files) {
+      if (! readEntry(cursor, end, file)) {
+        return false;
+      }
+    }
+    return validateImage(image);
+  }
+
+  static bool validateImage(ImageMetadata &image) {
+    if (image.files.empty() || image.currentDir >= image.files.size() || image.dataStart > image.memorySize ||
+        ! isAlignmentClass(image.defaultAlignment) || ! image.files[0].isDirectory ||
+        ! image.files[image.currentDir].isDirectory) {
+      return false;
+    }
+    for (size_t i = 0; i < image.files.size(); i++) {
+      if (! validEntry(image.files, i, image.dataStart, image.memorySize)) {
+        return false;
+      }
+    }
+    if (! linksTerminate(image.files)) {
+      return false;
+    }
+
+    image.layout.reset(image.dataStart, image.memorySize);
+    for (const auto &file: image.files) {
+      if (! file.isDirectory && file.spillState != SpillState::Spilled &&
+          ! image.layout.reserve(file.offset, file.size)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool installImage(ImageMetadata &image) {
+    if (! resetArena(image.memorySize)) {
+      return false;
+    }
+    applyMetadata(image);
+    return true;
+  }
+
+  bool resetArena(size_t newSize) {
+    spill.drain();
+    if (newSize == memorySize) {
+      std::fill_n(memory, memorySize, 0);
+    } else {
+      Backing fresh;
+      uint8_t *freshMemory = nullptr;
+      try {
+        freshMemory = fresh.resize(0, newSize);
+      } catch (const std::bad_alloc &e) {
+        std::cerr << "Failed to allocate memory: " << e.what() << std::endl;
+        return false;
+      }
+      backing.swap(fresh);
+      memory = freshMemory;
+      memorySize = newSize;
+    }
+
+    for (auto &file: fileTable) {
+      dropSpillCopy(file);
+    }
+    accessHeat.assign(heatRegions, 0);
+    dirtyPages.assign((memorySize / trackedPageSize + 64) / 64, 0);
+    markDirty(0, memorySize);
+    return true;
+  }
+
+  void applyMetadata(ImageMetadata &image) {
+    fileTable = std::move(image.files);
+    for (auto &file: fileTable) {
+      if (file.generation == 0) {
+        file.generation = ++fileGeneration;
+      }
+    }
+    dataStart = image.dataStart;
+    currentDir = image.currentDir;
+    defaultAlignment = image.defaultAlignment;
+    allocator = std::move(image.layout);
+    directoryIndex.rebuild(fileTable);
+  }
+
+  bool faultInAll() {
+    for (size_t i = 0; i < fileTable.size(); i++) {
+      if (! fileTable[i].isDirectory && ! faultIn(i)) {
+        std::cout << "Not enough arena space to load " << getFullPath(i) << "\n";
+        return false;
+      }
+    }
+    spill.drain();
+    return true;
+  }
+
+  // All-zero pages are never written and read back as holes.
+  void saveImage(const std::string &hostPath) {
+    if (! faultInAll()) {
+      return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::pair<size_t, size_t>> runs;
+    for (size_t page = 0; page < memorySize; page += imagePageSize) {
+      const size_t length = (std::min)(imagePageSize, memorySize - page);
+      if (isZeroBlock(memory + page, length)) {
+        continue;
+      }
+      if (! runs.empty() && runs.back().first + runs.back().second == page) {
+        runs.back().second += length;
+      } else {
+        runs.push_back({page, length});
+      }
+    }
+
+    std::string header(imageMagic, sizeof(imageMagic));
+    appendU64(header, 1);
+    const std::string metadata = serializeMetadata();
+    appendU64(header, metadata.size());
+    header += metadata;
+    appendU64(header, runs.size());
+    for (const auto &run: runs) {
+      appendU64(header, run.first);
+      appendU64(header, run.second);
+    }
+
+    HANDLE handle = CreateFileA(hostPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                                FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) {
+      std::cout << "Could not create " << hostPath << "\n";
+      return;
+    }
+    bool ok = writeFileAt(handle, 0, header.data(), header.size());
+    uint64_t position = header.size();
+    size_t live = 0;
+    for (size_t i = 0; ok && i < runs.size(); i++) {
+      ok = writeFileAt(handle, position, memory + runs[i].first, runs[i].second);
+      position += runs[i].second;
+      live += runs[i].second;
+    }
+    CloseHandle(handle);
+
+    if (! ok) {
+      std::cout << "Save to " << hostPath << " failed\n";
+      return;
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Saved " << formatSize(live) << " of live pages (" << formatSize(memorySize - live)
+              << " zero pages skipped, " << runs.size() << " runs) to " << hostPath << " in "
+              << formatDuration(seconds) << ", image " << formatSize(position) << "\n";
+  }
+
+  bool readImageHeader(HANDLE handle, uint64_t &version, uint64_t &position, uint64_t &fileSize,
+                       ImageMetadata &image) {
+    LARGE_INTEGER size;
+    char magic[sizeof(imageMagic)] = {};
+    uint64_t metadataLength = 0;
+    if (! GetFileSizeEx(handle, &size) || ! readFileAt(handle, 0, magic, sizeof(magic)) ||
+        ! std::equal(magic, magic + sizeof(magic), imageMagic) ||
+        ! readFileAt(handle, sizeof(magic), &version, sizeof(version)) ||
+        ! readFileAt(handle, sizeof(magic) + sizeof(version), &metadataLength, sizeof(metadataLength)) ||
+        metadataLength > static_cast<uint64_t>(size.QuadPart)) {
+      return false;
+    }
+
+    fileSize = static_cast<uint64_t>(size.QuadPart);
+    position = sizeof(magic) + sizeof(version) + sizeof(metadataLength);
+    std::vector<uint8_t> metadata(metadataLength);
+    if (! readFileAt(handle, position, metadata.data(), metadata.size()) ||
+        ! deserializeMetadata(metadata.data(), metadata.data() + metadata.size(), image)) {
+      return false;
+    }
+    position += metadataLength;
+    return true;
+  }
+
+  void saveChunkedImage(const std::string &hostPath) {
+    if (! faultInAll()) {
+      return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    const size_t chunkSize = static_cast<size_t>(4) << 20;
+    const size_t chunkCount = (memorySize + chunkSize - 1) / chunkSize;
+    std::string header(imageMagic, sizeof(imageMagic));
+    appendU64(header, 2);
+    const std::string metadata = serializeMetadata();
+    appendU64(header, metadata.size());
+    header += metadata;
+    appendU64(header, chunkSize);
+    appendU64(header, chunkCount);
+
+    HANDLE handle = CreateFileA(hostPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                                FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) {
+      std::cout << "Could not create " << hostPath << "\n";
+      return;
+    }
+
+    std::vector<ImageChunk> table(chunkCount);
+    std::atomic<uint64_t> position{header.size() + table.size() * sizeof(ImageChunk)};
+    std::atomic<size_t> nextChunk{0};
+    std::atomic<bool> ok{true};
+    auto worker = [&] {
+      COMPRESSOR_HANDLE compressor = nullptr;
+      if (! CreateCompressor(COMPRESS_ALGORITHM_XPRESS | COMPRESS_RAW, nullptr, &compressor)) {
+        compressor = nullptr;
+      }
+      std::vector<uint8_t> buffer(chunkSize);
+      for (size_t chunk = nextChunk++; ok && chunk < chunkCount; chunk = nextChunk++) {
+        const uint8_t *data = memory + chunk * chunkSize;
+        const size_t length = (std::min)(chunkSize, memorySize - chunk * chunkSize);
+        ImageChunk &entry = table[chunk];
+        if (isZeroBlock(data, length)) {
+          entry = {0, 0, ChunkEncoding::Zero, 0};
+          continue;
+        }
+
+        size_t compressed = 0;
+        entry.crc = crc32(data, length);
+        if (compressor != nullptr &&
+            Compress(compressor, data, length, buffer.data(), length, &compressed) &&
+            compressed < length) {
+          entry.encoding = ChunkEncoding::Xpress;
+          entry.storedLength = compressed;
+        } else {
+          entry.encoding = ChunkEncoding::Raw;
+          entry.storedLength = length;
+        }
+        entry.fileOffset = position.fetch_add(entry.storedLength);
+        if (! writeFileAt(handle, entry.fileOffset,
+                          entry.encoding == ChunkEncoding::Raw ? data : buffer.data(),
+                          entry.storedLength)) {
+          ok = false;
+        }
+      }
+      if (compressor != nullptr) {
+        CloseCompressor(compressor);
+      }
+    };
+
+    const size_t threads = (std::max)(static_cast<size_t>(1),
+                                      (std::min)(static_cast<size_t>(std::thread::hardware_concurrency()),
+                                                 chunkCount));
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < threads; i++) {
+      workers.emplace_back(worker);
+    }
+    worker();
+    for (auto &thread: workers) {
+      thread.join();
+    }
+    ok = ok && writeFileAt(handle, 0, header.data(), header.size()) &&
+         writeFileAt(handle, header.size(), table.data(), table.size() * sizeof(ImageChunk));
+    CloseHandle(handle);
+
+    if (! ok) {
+      std::cout << "Save to " << hostPath << " failed\n";
+      return;
+    }
+    std::array<size_t, 3> encodings = {};
+    for (const auto &entry: table) {
+      encodings[static_cast<size_t>(entry.encoding)]++;
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Saved " << chunkCount << " chunks of " << formatSize(chunkSize) << " ("
+              << encodings[2] << " compressed, " << encodings[1] << " stored, " << encodings[0]
+              << " zero) to " << hostPath << " in " << formatDuration(seconds) << " on " << threads
+              << (threads == 1 ? " thread" : " threads") << ", image " << formatSize(position) << "\n";
+  }
+
+  void startChunkedLoad(HANDLE handle, uint64_t position, uint64_t fileSize, ImageMetadata &image,
+                        const std::string &hostPath) {
+    uint64_t geometry[2] = {};
+    std::vector<ImageChunk> table;
+    bool ok = readFileAt(handle, position, geometry, sizeof(geometry)) && geometry[0] > 0 &&
+              geometry[1] == (image.memorySize + geometry[0] - 1) / geometry[0];
+    if (ok) {
+      table.resize(geometry[1]);
+      ok = readFileAt(handle, position + sizeof(geometry), table.data(), table.size() * sizeof(ImageChunk));
+    }
+    for (size_t chunk = 0; ok && chunk < table.size(); chunk++) {
+      const ImageChunk &entry = table[chunk];
+      const uint64_t length = (std::min)(geometry[0], image.memorySize - chunk * geometry[0]);
+      ok = entry.encoding <= ChunkEncoding::Xpress && entry.storedLength <= fileSize &&
+           entry.fileOffset <= fileSize - entry.storedLength &&
+           (entry.encoding != ChunkEncoding::Raw || entry.storedLength == length);
+    }
+    if (! ok || ! installImage(image)) {
+      CloseHandle(handle);
+      if (! ok) {
+        std::cout << hostPath << " is not a valid memory image\n";
+      }
+      return;
+    }
+
+    imageLoad.path = hostPath;
+    imageLoad.total = table.size();
+    imageLoad.chunkSize = geometry[0];
+    imageLoad.done = 0;
+    imageLoad.corrupt.clear();
+    imageLoad.start = std::chrono::steady_clock::now();
+    imageLoad.thread = std::thread([this, handle, chunkSize = geometry[0], table = std::move(table)] {
+      std::atomic<size_t> nextChunk{0};
+      auto worker = [&] {
+        DECOMPRESSOR_HANDLE decompressor = nullptr;
+        if (! CreateDecompressor(COMPRESS_ALGORITHM_XPRESS | COMPRESS_RAW, nullptr, &decompressor)) {
+          decompressor = nullptr;
+        }
+        std::vector<uint8_t> buffer;
+        for (size_t chunk = nextChunk++; chunk < table.size(); chunk = nextChunk++) {
+          const ImageChunk &entry = table[chunk];
+          uint8_t *data = memory + chunk * chunkSize;
+          const size_t length = (std::min)(chunkSize, memorySize - chunk * chunkSize);
+          bool valid = true;
+          if (entry.encoding == ChunkEncoding::Raw) {
+            valid = readFileAt(handle, entry.fileOffset, data, length);
+          } else if (entry.encoding == ChunkEncoding::Xpress) {
+            size_t decoded = 0;
+            buffer.resize(entry.storedLength);
+            valid = decompressor != nullptr &&
+                    readFileAt(handle, entry.fileOffset, buffer.data(), buffer.size()) &&
+                    Decompress(decompressor, buffer.data(), buffer.size(), data, length, &decoded) &&
+                    decoded == length;
+          }
+          if (entry.encoding != ChunkEncoding::Zero && (! valid || crc32(data, length) != entry.crc)) {
+            std::fill_n(data, length, 0);
+            std::lock_guard<std::mutex> guard(imageLoad.mutex);
+            imageLoad.corrupt.push_back(chunk);
+          }
+          imageLoad.done++;
+        }
+        if (decompressor != nullptr) {
+          CloseDecompressor(decompressor);
+        }
+      };
+
+      const size_t threads = (std::max)(static_cast<size_t>(1),
+                                        (std::min)(static_cast<size_t>(std::thread::hardware_concurrency()),
+                                                   table.size()));
+      std::vector<std::thread> workers;
+      for (size_t i = 1; i < threads; i++) {
+        workers.emplace_back(worker);
+      }
+      worker();
+      for (auto &thread: workers) {
+        thread.join();
+      }
+      CloseHandle(handle);
+    });
+
+    std::cout << "Loaded metadata for " << fileTable.size() - 1 << " entries from " << hostPath
+              << "; decoding " << imageLoad.total << " chunks in the background\n";
+  }
+
+  static bool isMetadataCommand(const std::string &command) {
+    static const std::set<std::string> commands = {"help", "ls", "cd", "pwd", "df", "mkdir", "touch",
+                                                   "memsize", "env", "stats", "quota"};
+    return commands.count(command) > 0;
+  }
+
+  void finishImageLoad() {
+    if (! imageLoad.thread.joinable()) {
+      return;
+    }
+    if (imageLoad.done < imageLoad.total) {
+      std::cout << "Waiting for image data (" << imageLoad.done << "/" << imageLoad.total
+                << " chunks decoded)\n";
+    }
+    imageLoad.thread.join();
+    markDirty(0, memorySize);
+
+    const double seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - imageLoad.start).count();
+    std::sort(imageLoad.corrupt.begin(), imageLoad.corrupt.end());
+    for (size_t chunk: imageLoad.corrupt) {
+      const size_t offset = chunk * imageLoad.chunkSize;
+      std::cout << "Chunk " << chunk << " of " << imageLoad.path << " failed its checksum; arena "
+                << offset << ".." << (std::min)(offset + imageLoad.chunkSize, memorySize)
+                << " was zeroed\n";
+    }
+    std::cout << "Image data ready: " << imageLoad.total << " chunks, " << formatSize(memorySize)
+              << " within " << formatDuration(seconds) << " of load, " << imageLoad.corrupt.size()
+              << " corrupt\n";
+  }
+
+  void loadImage(const std::string &hostPath) {
+    HANDLE handle = CreateFileA(hostPath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) {
+      std::cout << "Could not open " << hostPath << "\n";
+      return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t version = 0;
+    uint64_t position = 0;
+    uint64_t fileSize = 0;
+    ImageMetadata image;
+    bool ok = readImageHeader(handle, version, position, fileSize, image);
+    if (ok && version == 2) {
+      startChunkedLoad(handle, position, fileSize, image, hostPath);
+      return;
+    }
+
+    std::vector<uint64_t> runs;
+    uint64_t runCount = 0;
+    ok = ok && version == 1 && readFileAt(handle, position, &runCount, sizeof(runCount)) &&
+         runCount <= fileSize / 16;
+    position += sizeof(runCount);
+    if (ok) {
+      runs.resize(runCount * 2);
+      ok = readFileAt(handle, position, runs.data(), runs.size() * sizeof(uint64_t));
+      position += runs.size() * sizeof(uint64_t);
+    }
+    for (size_t i = 0; ok && i < runs.size(); i += 2) {
+      ok = runs[i] <= image.memorySize && runs[i + 1] <= image.memorySize - runs[i];
+    }
+    if (! ok) {
+      CloseHandle(handle);
+      std::cout << hostPath << " is not a valid memory image\n";
+      return;
+    }
+
+    if (! installImage(image)) {
+      CloseHandle(handle);
+      return;
+    }
+    size_t live = 0;
+    for (size_t i = 0; ok && i < runs.size(); i += 2) {
+      ok = readFileAt(handle, position, memory + runs[i], runs[i + 1]);
+      position += runs[i + 1];
+      live += runs[i + 1];
+    }
+    CloseHandle(handle);
+
+    if (! ok) {
+      std::cout << "Image data in " << hostPath << " is truncated; loaded contents are incomplete\n";
+      return;
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Loaded " << formatSize(memorySize) << " arena (" << formatSize(live) << " live, "
+              << fileTable.size() - 1 << " entries) from " << hostPath << " in "
+              << formatDuration(seconds) << "\n";
+  }
+
+  void diffRanges(const std::string &first, const std::string &second) {
+    ArenaRange a;
+    ArenaRange b;
+    if (! resolveRange(first, a) || ! resolveRange(second, b) ||
+        (a.file != SIZE_MAX && ! resolveRange(first, a))) {
+      return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    const size_t common = (std::min)(a.length, b.length);
+    const uint8_t *x = memory + a.offset;
+    const uint8_t *y = memory + b.offset;
+    std::vector<std::pair<size_t, size_t>> ranges;
+    size_t differing = 0;
+    for (size_t position = 0; a.offset != b.offset && position < common;) {
+      position += firstDifference(x + position, y + position, common - position);
+      if (position == common) {
+        break;
+      }
+      size_t end = position + firstEqualBlock(x + position, y + position, common - position);
+      while (x[end - 1] == y[end - 1]) {
+        end--;
+      }
+      ranges.push_back({position, end - position});
+      differing += end - position;
+      position = end;
+    }
+    if (a.length != b.length) {
+      ranges.push_back({common, (std::max)(a.length, b.length) - common});
+      differing += ranges.back().second;
+    }
+    recordAccess(a.offset, a.length);
+    recordAccess(b.offset, b.length);
+
+    const size_t shown = 32;
+    for (size_t i = 0; i < ranges.size() && i < shown; i++) {
+      std::cout << "  " << ranges[i].first << " +" << ranges[i].second;
+      if (ranges[i].first >= common) {
+        std::cout << " (only in " << (a.length > b.length ? first : second) << ")";
+      }
+      std::cout << "\n";
+    }
+    if (ranges.size() > shown) {
+      std::cout << "  ... " << ranges.size() - shown << " more\n";
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (ranges.empty()) {
+      std::cout << "Identical";
+    } else {
+      std::cout << ranges.size() << (ranges.size() == 1 ? " range differs, " : " ranges differ, ")
+                << formatSize(differing);
+    }
+    std::cout << " (" << formatSize(common) << " compared";
+    if (a.offset == b.offset) {
+      std::cout << ", same extent";
+    }
+    std::cout << ") in " << formatDuration(seconds) << "\n";
+  }
+
+  struct SnapshotIndex {
+    ImageMetadata image;
+    size_t blockSize = 0;
+    std::vector<uint32_t> crcs;
+    std::vector<uint8_t> zero;
+
+    bool sameBlock(const SnapshotIndex &other, size_t block) const {
+      if (block >= crcs.size() || block >= other.crcs.size()) {
+        return false;
+      }
+      return zero[block] == other.zero[block] && (zero[block] || crcs[block] == other.crcs[block]);
+    }
+  };
+
+  static void checksumBlock(const uint8_t *data, size_t length, SnapshotIndex &index, size_t block) {
+    index.zero[block] = isZeroBlock(data, length);
+    index.crcs[block] = index.zero[block] ? 0 : crc32(data, length);
+  }
+
+  size_t snapshotChunkSize(const std::string &spec) {
+    if (spec == ".") {
+      return 0;
+    }
+    HANDLE handle = CreateFileA(spec.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) {
+      return 0;
+    }
+    uint64_t version = 0;
+    uint64_t position = 0;
+    uint64_t fileSize = 0;
+    uint64_t chunkSize = 0;
+    ImageMetadata image;
+    if (! readImageHeader(handle, version, position, fileSize, image) || version != 2 ||
+        ! readFileAt(handle, position, &chunkSize, sizeof(chunkSize))) {
+      chunkSize = 0;
+    }
+    CloseHandle(handle);
+    return static_cast<size_t>(chunkSize);
+  }
+
+  bool readSnapshot(const std::string &spec, size_t blockSize, SnapshotIndex &index) {
+    if (spec == ".") {
+      if (! faultInAll()) {
+        return false;
+      }
+      index.image = {memorySize, dataStart, currentDir, defaultAlignment, fileTable, {}};
+      index.blockSize = blockSize;
+      const size_t blocks = (memorySize + blockSize - 1) / blockSize;
+      index.crcs.assign(blocks, 0);
+      index.zero.assign(blocks, 0);
+      for (size_t block = 0; block < blocks; block++) {
+        const size_t offset = block * blockSize;
+        checksumBlock(memory + offset, (std::min)(blockSize, memorySize - offset), index, block);
+      }
+      return true;
+    }
+
+    HANDLE handle = CreateFileA(spec.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) {
+      std::cout << "Could not open " << spec << "\n";
+      return false;
+    }
+    uint64_t version = 0;
+    uint64_t position = 0;
+    uint64_t fileSize = 0;
+    bool ok = readImageHeader(handle, version, position, fileSize, index.image);
+    const size_t arenaSize = index.image.memorySize;
+
+    if (ok && version == 2) {
+      uint64_t geometry[2] = {};
+      ok = readFileAt(handle, position, geometry, sizeof(geometry)) && geometry[0] > 0 &&
+           geometry[1] == (arenaSize + geometry[0] - 1) / geometry[0];
+      std::vector<ImageChunk> table(ok ? geometry[1] : 0);
+      ok = ok && readFileAt(handle, position + sizeof(geometry), table.data(), table.size() * sizeof(ImageChunk));
+      index.blockSize = static_cast<size_t>(geometry[0]);
+      for (const auto &entry: table) {
+        index.zero.push_back(entry.encoding == ChunkEncoding::Zero);
+        index.crcs.push_back(entry.crc);
+      }
+    } else if (ok && version == 1) {
+      uint64_t runCount = 0;
+      ok = readFileAt(handle, position, &runCount, sizeof(runCount)) && runCount <= fileSize / 16;
+      std::vector<uint64_t> runs(ok ? runCount * 2 : 0);
+      ok = ok && readFileAt(handle, position + sizeof(runCount), runs.data(), runs.size() * sizeof(uint64_t));
+      uint64_t dataPosition = position + sizeof(runCount) + runs.size() * sizeof(uint64_t);
+
+      index.blockSize = blockSize;
+      const size_t blocks = (arenaSize + blockSize - 1) / blockSize;
+      index.crcs.assign(blocks, 0);
+      index.zero.assign(blocks, 1);
+      std::vector<uint8_t> buffer(blockSize);
+      size_t run = 0;
+      for (size_t block = 0; ok && block < blocks; block++) {
+        const size_t begin = block * blockSize;
+        const size_t length = (std::min)(blockSize, arenaSize - begin);
+        if (run >= runs.size() || runs[run] >= begin + length) {
+          continue;
+        }
+        std::fill(buffer.begin(), buffer.end(), 0);
+        while (ok && run < runs.size() && runs[run] < begin + length) {
+          const size_t from = (std::max)(static_cast<size_t>(runs[run]), begin);
+          const size_t to = (std::min)(static_cast<size_t>(runs[run] + runs[run + 1]), begin + length);
+          ok = runs[run] + runs[run + 1] <= arenaSize &&
+               readFileAt(handle, dataPosition + (from - runs[run]), buffer.data() + (from - begin), to - from);
+          if (runs[run] + runs[run + 1] > begin + length) {
+            break;
+          }
+          dataPosition += runs[run + 1];
+          run += 2;
+        }
+        checksumBlock(buffer.data(), length, index, block);
+      }
+    } else {
+      ok = false;
+    }
+    CloseHandle(handle);
+
+    if (! ok) {
+      std::cout << spec << " is not a valid memory image\n";
+    }
+    return ok;
+  }
+
+  void snapshotDiff(const std::string &first, const std::string &second) {
+    auto start = std::chrono::steady_clock::now();
+    const size_t firstChunk = snapshotChunkSize(first);
+    const size_t secondChunk = snapshotChunkSize(second);
+    if (firstChunk != 0 && secondChunk != 0 && firstChunk != secondChunk) {
+      std::cout << "Chunk sizes differ (" << formatSize(firstChunk) << " vs " << formatSize(secondChunk)
+                << "); only metadata can be compared\n";
+    }
+    const size_t blockSize = firstChunk != 0 ? firstChunk : secondChunk != 0 ? secondChunk : imagePageSize;
+    SnapshotIndex a;
+    SnapshotIndex b;
+    if (! readSnapshot(first, blockSize, a) || ! readSnapshot(second, blockSize, b)) {
+      return;
+    }
+    const bool contents = a.blockSize == b.blockSize;
+
+    if (a.image.memorySize != b.image.memorySize) {
+      std::cout << "Arena resized from " << formatSize(a.image.memorySize) << " to "
+                << formatSize(b.image.memorySize) << "\n";
+    }
+
+    std::map<std::string, size_t> before;
+    for (size_t i = 1; i < a.image.files.size(); i++) {
+      before[pathIn(a.image.files, i)] = i;
+    }
+
+    size_t added = 0;
+    size_t removed = 0;
+    size_t changed = 0;
+    size_t unchanged = 0;
+    size_t changedBytes = 0;
+    for (size_t j = 1; j < b.image.files.size(); j++) {
+      const FileEntry &now = b.image.files[j];
+      const std::string path = pathIn(b.image.files, j);
+      auto match = before.find(path);
+      if (match == before.end() || a.image.files[match->second].isDirectory != now.isDirectory) {
+        std::cout << "+ " << path << (now.isDirectory ? "/" : " (" + formatSize(now.size) + ")") << "\n";
+        added++;
+        continue;
+      }
+      const FileEntry &then = a.image.files[match->second];
+      before.erase(match);
+      if (now.isDirectory) {
+        continue;
+      }
+
+      std::vector<std::pair<size_t, size_t>> ranges;
+      const bool moved = then.offset != now.offset && then.size > 0 && now.size > 0;
+      const size_t common = (std::min)(then.size, now.size);
+      for (size_t offset = 0; ! moved && contents && offset < common;) {
+        const size_t block = (now.offset + offset) / blockSize;
+        const size_t end = (std::min)((block + 1) * blockSize - now.offset, common);
+        if (! a.sameBlock(b, block)) {
+          if (! ranges.empty() && ranges.back().first + ranges.back().second == offset) {
+            ranges.back().second += end - offset;
+          } else {
+            ranges.push_back({offset, end - offset});
+          }
+        }
+        offset = end;
+      }
+      if (! moved && ranges.empty() && then.size == now.size) {
+        unchanged++;
+        continue;
+      }
+
+      changed++;
+      std::cout << "~ " << path;
+      if (then.size != now.size) {
+        std::cout << " resized " << formatSize(then.size) << " -> " << formatSize(now.size);
+      }
+      if (moved) {
+        std::cout << " moved in the arena; contents not compared\n";
+        continue;
+      }
+      for (size_t i = 0; i < ranges.size() && i < 8; i++) {
+        std::cout << (i == 0 ? " changed " : ", ") << ranges[i].first << " +" << ranges[i].second;
+        changedBytes += ranges[i].second;
+      }
+      if (ranges.size() > 8) {
+        std::cout << ", ... " << ranges.size() - 8 << " more";
+        for (size_t i = 8; i < ranges.size(); i++) {
+          changedBytes += ranges[i].second;
+        }
+      }
+      std::cout << "\n";
+    }
+    for (const auto &gone: before) {
+      std::cout << "- " << gone.first << (a.image.files[gone.second].isDirectory ? "/" : "") << "\n";
+      removed++;
+    }
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << added << " added, " << removed << " removed, " << changed << " changed ("
+              << formatSize(changedBytes) << " in changed blocks), " << unchanged << " unchanged; "
+              << formatSize(blockSize) << " blocks, " << formatDuration(seconds) << "\n";
+  }
+
+  void markDirty(size_t offset, size_t length) {
+    if (length == 0) {
+      return;
+    }
+    const size_t last = (std::min)((offset + length - 1) / trackedPageSize, dirtyPages.size() * 64 - 1);
+    for (size_t page = offset / trackedPageSize; page <= last; page++) {
+      dirtyPages[page / 64] |= 1ULL << (page % 64);
+    }
+  }
+
+  size_t countDirtyPages() {
+    size_t count = 0;
+    for (uint64_t word: dirtyPages) {
+      count += std::bitset<64>(word).count();
+    }
+    return count;
+  }
+
+  // Called with the gate held.
+  bool takeDirtyPages(size_t &cursor, size_t maxBytes, size_t &sentSize, bool skipZeroPages,
+                      std::vector<uint8_t> &out) {
+    if (sentSize != memorySize) {
+      appendRecord(out, {StreamRecord::Resize, 0, memorySize}, nullptr);
+      sentSize = memorySize;
+    }
+
+    const size_t pages = (memorySize + trackedPageSize - 1) / trackedPageSize;
+    auto takePage = [&](size_t page) {
+      if ((dirtyPages[page / 64] >> (page % 64) & 1) == 0) {
+        return false;
+      }
+      dirtyPages[page / 64] &= ~(1ULL << (page % 64));
+      const size_t offset = page * trackedPageSize;
+      return ! skipZeroPages ||
+             ! isZeroBlock(memory + offset, (std::min)(trackedPageSize, memorySize - offset));
+    };
+
+    const size_t budget = maxBytes / trackedPageSize;
+    size_t taken = 0;
+    for (size_t scanned = 0; cursor < pages && taken < budget && scanned < budget * 4; scanned++) {
+      if (cursor % 64 == 0 && dirtyPages[cursor / 64] == 0) {
+        cursor += 64;
+        continue;
+      }
+      if (! takePage(cursor++)) {
+        continue;
+      }
+      const size_t first = cursor - 1;
+      taken++;
+      while (cursor < pages && taken < budget && takePage(cursor)) {
+        cursor++;
+        taken++;
+      }
+      const size_t offset = first * trackedPageSize;
+      const size_t length = (std::min)(cursor * trackedPageSize, memorySize) - offset;
+      appendRecord(out, {StreamRecord::Pages, offset, length}, memory + offset);
+    }
+    return cursor >= pages;
+  }
+
+  void migrate(SOCKET socket, const std::string &path) {
+    const size_t batchBytes = static_cast<size_t>(4) << 20;
+    const size_t finalThreshold = static_cast<size_t>(16) << 20;
+    const size_t maxRounds = 16;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<uint8_t> buffer;
+    size_t sentSize = 0;
+    size_t sentBytes = 0;
+    size_t rounds = 0;
+    bool ok = true;
+    {
+      typename Sync::Lock gate(sync);
+      markDirty(0, memorySize);
+      const StreamHeader begin = {StreamRecord::Begin, 0, memorySize};
+      sentSize = memorySize;
+      ok = sendAll(socket, &begin, sizeof(begin));
+    }
+
+    size_t remaining = SIZE_MAX;
+    while (ok && rounds < maxRounds) {
+      rounds++;
+      size_t cursor = 0;
+      for (bool done = false; ok && ! done;) {
+        buffer.clear();
+        {
+          typename Sync::Lock gate(sync);
+          done = takeDirtyPages(cursor, batchBytes, sentSize, rounds == 1, buffer);
+        }
+        sentBytes += buffer.size();
+        ok = sendAll(socket, buffer.data(), buffer.size());
+      }
+
+      typename Sync::Lock gate(sync);
+      const size_t dirty = countDirtyPages();
+      if (dirty * trackedPageSize <= finalThreshold || dirty >= remaining) {
+        break;
+      }
+      remaining = dirty;
+    }
+
+    typename Sync::Lock gate(sync);
+    auto freeze = std::chrono::steady_clock::now();
+    const size_t frozenSize = memorySize;
+    announceGrowth = false;
+    for (size_t i = 0; ok && i < fileTable.size(); i++) {
+      ok = fileTable[i].isDirectory || faultIn(i);
+    }
+    announceGrowth = true;
+    size_t cursor = 0;
+    for (bool done = false; ok && ! done;) {
+      buffer.clear();
+      done = takeDirtyPages(cursor, batchBytes, sentSize, false, buffer);
+      sentBytes += buffer.size();
+      ok = sendAll(socket, buffer.data(), buffer.size());
+    }
+    if (ok) {
+      const std::string metadata = serializeMetadata();
+      const StreamHeader commit = {StreamRecord::Commit, 0, metadata.size()};
+      StreamHeader ack = {};
+      ok = sendAll(socket, &commit, sizeof(commit)) && sendAll(socket, metadata.data(), metadata.size()) &&
+           recvAll(socket, &ack, sizeof(ack)) && ack.type == StreamRecord::Ack;
+    }
+    const auto end = std::chrono::steady_clock::now();
+    closesocket(socket);
+
+    std::ostringstream report;
+    if (memorySize != frozenSize) {
+      report << "Arena grew to " << formatSize(memorySize) << " to load spilled files for migration\n";
+    }
+    if (! ok) {
+      markDirty(0, memorySize);
+      report << "Migration to " << path << " failed; this console keeps the arena\n";
+    } else {
+      migratedTo = path;
+      report << "Migrated to " << path << ": " << formatSize(sentBytes) << " in " << rounds
+             << (rounds == 1 ? " round, " : " rounds, ") << formatDuration(std::chrono::duration<double>(end - start).count())
+             << " total, " << formatDuration(std::chrono::duration<double>(end - freeze).count())
+             << " frozen\n";
+    }
+    migrationReport = report.str();
+    migrating = false;
+  }
+
+  static bool requireConcurrentBuild(const char *feature) {
+    if (! Sync::concurrent) {
+      std::cout << feature << " runs on a background thread; rebuild with MEMSHELL_MULTITHREADED\n";
+    }
+    return Sync::concurrent;
+  }
+
+  void startMigration(const std::string &path) {
+    if (! requireConcurrentBuild("Migration")) {
+      return;
+    }
+    if (migrating || replication.active || follower.readOnly) {
+      std::cout << (follower.readOnly ? "A read-only replica cannot migrate\n"
+                                      : "Replication or migration is already running\n");
+      return;
+    }
+    if (migrationThread.joinable()) {
+      migrationThread.join();
+    }
+
+    SOCKET socket = INVALID_SOCKET;
+    const sockaddr_un address = unixAddress(path);
+    if (startWinsock()) {
+      socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    }
+    if (socket == INVALID_SOCKET ||
+        connect(socket, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == SOCKET_ERROR) {
+      if (socket != INVALID_SOCKET) {
+        closesocket(socket);
+      }
+      std::cout << "Could not connect to " << path << "\n";
+      return;
+    }
+
+    finishImageLoad();
+    migrating = true;
+    migrationThread = std::thread([this, socket, path] { migrate(socket, path); });
+    std::cout << "Migrating " << formatSize(memorySize) << " arena to " << path
+              << " in the background\n";
+  }
+
+  static uint64_t wallMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+
+  static constexpr size_t maxQueuedBytes = static_cast<size_t>(256) << 20;
+  static constexpr size_t maxApplyBytes = static_cast<size_t>(1) << 30;
+  static constexpr int replicationStallSeconds = 30;
+
+  size_t shipChanges(bool initial) {
+    const size_t batchBytes = static_cast<size_t>(4) << 20;
+    std::vector<uint8_t> records;
+    size_t queued = 0;
+    if (initial) {
+      markDirty(0, memorySize);
+      appendRecord(records, {StreamRecord::Begin, 0, memorySize}, nullptr);
+      replication.sentSize = memorySize;
+      replication.shippedHeader.clear();
+      replication.shippedEntries.clear();
+    }
+    size_t cursor = 0;
+    for (bool done = false; ! done;) {
+      done = takeDirtyPages(cursor, batchBytes, replication.sentSize, initial, records);
+      if (records.size() >= batchBytes && ! queueRecords(records, queued)) {
+        return queued;
+      }
+    }
+
+    std::string header;
+    for (size_t field: {memorySize, dataStart, currentDir, defaultAlignment, fileTable.size()}) {
+      appendU64(header, field);
+    }
+    std::string updates;
+    std::string entry;
+    size_t updateCount = 0;
+    replication.shippedEntries.resize(fileTable.size());
+    for (size_t i = 0; i < fileTable.size(); i++) {
+      const FileEntry &file = fileTable[i];
+      const bool spilled = file.spillState == SpillState::Spilled;
+      entry.clear();
+      appendEntry(entry, file);
+      appendU64(entry, spilled ? file.spillOffset : SIZE_MAX);
+      if (entry == replication.shippedEntries[i]) {
+        continue;
+      }
+      if (spilled) {
+        appendRecord(records, {StreamRecord::Spill, i, file.size}, nullptr);
+        for (size_t done = 0; done < file.size;) {
+          const size_t length = (std::min)(batchBytes, file.size - done);
+          const size_t start = records.size();
+          records.resize(start + length);
+          if (! spill.read(file.spillOffset + done, records.data() + start, length)) {
+            abandonReplication("could not read " + getFullPath(i) + " from the spill file");
+            return queued;
+          }
+          done += length;
+          if (records.size() >= batchBytes && ! queueRecords(records, queued)) {
+            return queued;
+          }
+        }
+      }
+      appendU64(updates, i);
+      updates += entry;
+      updateCount++;
+      replication.shippedEntries[i] = entry;
+    }
+
+    const bool tableChanged = updateCount > 0 || header != replication.shippedHeader;
+    if (queued == 0 && records.empty() && ! tableChanged) {
+      return queued;
+    }
+
+    std::string payload;
+    appendU64(payload, wallMicros());
+    if (tableChanged) {
+      payload += header;
+      appendU64(payload, updateCount);
+      payload += updates;
+      replication.shippedHeader = std::move(header);
+    }
+    if (payload.size() > maxApplyBytes) {
+      abandonReplication("the file table outgrew a single transaction");
+      return queued;
+    }
+    queueRecords(records, queued, &payload);
+    return queued;
+  }
+
+  bool queueRecords(std::vector<uint8_t> &records, size_t &queued, const std::string *payload = nullptr) {
+    std::unique_lock<std::mutex> guard(replication.mutex);
+    if (! replication.drained.wait_for(guard, std::chrono::seconds(replicationStallSeconds), [&] {
+          return replication.queuedBytes <= maxQueuedBytes || ! replication.active;
+        })) {
+      guard.unlock();
+      abandonReplication("the follower fell more than " + formatSize(maxQueuedBytes) + " behind");
+      return false;
+    }
+    if (! replication.active) {
+      return false;
+    }
+    if (payload != nullptr) {
+      const uint64_t sequence = ++replication.shipped;
+      appendRecord(records, {StreamRecord::Apply, sequence, payload->size()}, payload->data());
+      replication.inFlight[sequence] = std::chrono::steady_clock::now();
+    }
+    queued += records.size();
+    replication.queuedBytes += records.size();
+    replication.queue.push_back(std::move(records));
+    records.clear();
+    replication.ready.notify_one();
+    return true;
+  }
+
+  void abandonReplication(const std::string &problem) {
+    {
+      std::lock_guard<std::mutex> guard(replication.mutex);
+      replication.problem = problem;
+      replication.active = false;
+    }
+    shutdown(replication.socket, SD_BOTH);
+  }
+
+  void shipLoop() {
+    while (true) {
+      std::unique_lock<std::mutex> guard(replication.mutex);
+      replication.ready.wait(guard, [&] { return replication.stopping || ! replication.queue.empty(); });
+      if (replication.stopping) {
+        return;
+      }
+      std::vector<uint8_t> records = std::move(replication.queue.front());
+      replication.queue.pop_front();
+      guard.unlock();
+
+      const bool sent = sendAll(replication.socket, records.data(), records.size());
+      guard.lock();
+      replication.queuedBytes -= records.size();
+      replication.drained.notify_all();
+      if (! sent) {
+        if (replication.problem.empty()) {
+          replication.problem = "lost the connection";
+        }
+        replication.active = false;
+        return;
+      }
+    }
+  }
+
+  void ackLoop() {
+    StreamHeader ack = {};
+    while (recvAll(replication.socket, &ack, sizeof(ack)) && ack.type == StreamRecord::Ack) {
+      std::lock_guard<std::mutex> guard(replication.mutex);
+      auto sent = replication.inFlight.find(ack.offset);
+      if (sent != replication.inFlight.end()) {
+        replication.ackLag = std::chrono::duration<double>(std::chrono::steady_clock::now() - sent->second).count();
+      }
+      replication.inFlight.erase(replication.inFlight.begin(), replication.inFlight.upper_bound(ack.offset));
+      replication.acked = ack.offset;
+    }
+    std::lock_guard<std::mutex> guard(replication.mutex);
+    replication.active = false;
+    replication.drained.notify_all();
+  }
+
+  void startReplication(const std::string &path) {
+    if (! requireConcurrentBuild("Replication")) {
+      return;
+    }
+    if (replication.active || migrating || follower.readOnly) {
+      std::cout << (follower.readOnly ? "A read-only replica cannot replicate\n"
+                                      : "Replication or migration is already running\n");
+      return;
+    }
+    stopReplication();
+
+    SOCKET socket = INVALID_SOCKET;
+    const sockaddr_un address = unixAddress(path);
+    if (startWinsock()) {
+      socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    }
+    if (socket == INVALID_SOCKET ||
+        connect(socket, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == SOCKET_ERROR) {
+      if (socket != INVALID_SOCKET) {
+        closesocket(socket);
+      }
+      std::cout << "Could not connect to " << path << "\n";
+      return;
+    }
+
+    replication.socket = socket;
+    replication.path = path;
+    replication.shipped = 0;
+    replication.acked = 0;
+    replication.problem.clear();
+    replication.stopping = false;
+    replication.active = true;
+    replication.shipper = std::thread([this] { shipLoop(); });
+    replication.ackReader = std::thread([this] { ackLoop(); });
+    const size_t initialBytes = shipChanges(true);
+    std::cout << "Replicating to " << path << ", initial sync of " << formatSize(initialBytes) << "\n";
+  }
+
+  void stopReplication() {
+    if (replication.socket == INVALID_SOCKET) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> guard(replication.mutex);
+      replication.stopping = true;
+      replication.ready.notify_one();
+    }
+    shutdown(replication.socket, SD_BOTH);
+    replication.shipper.join();
+    replication.ackReader.join();
+    closesocket(replication.socket);
+    replication.socket = INVALID_SOCKET;
+    replication.active = false;
+    replication.queue.clear();
+    replication.inFlight.clear();
+    replication.queuedBytes = 0;
+  }
+
+  struct ReceivedSpill {
+    size_t index;
+    size_t offset;
+    size_t size;
+    bool used;
+  };
+
+  struct SpooledPages {
+    size_t offset;
+    size_t spillOffset;
+    size_t length;
+  };
+
+  void followLoop() {
+    follower.socket = accept(follower.listener, nullptr, nullptr);
+    DeleteFileA(follower.path.c_str());
+    if (follower.socket == INVALID_SOCKET) {
+      return;
+    }
+    if (follower.promoted) {
+      shutdown(follower.socket, SD_BOTH);
+      return;
+    }
+    follower.connected = true;
+
+    const size_t stagedLimit = static_cast<size_t>(64) << 20;
+    std::vector<uint8_t> staged;
+    std::vector<ReceivedSpill> received;
+    std::vector<SpooledPages> spooled;
+    std::vector<std::pair<size_t, size_t>> written;
+    std::vector<uint8_t> buffer;
+    size_t stagedSize = memorySize;
+    size_t stagedPages = 0;
+    std::string problem;
+    while (problem.empty()) {
+      StreamHeader header = {};
+      if (! recvAll(follower.socket, &header, sizeof(header))) {
+        problem = "primary disconnected";
+        break;
+      }
+      switch (header.type) {
+        case StreamRecord::Begin:
+        case StreamRecord::Resize:
+          stagedSize = header.length;
+          appendRecord(staged, header, nullptr);
+          continue;
+        case StreamRecord::Spill: {
+          const size_t offset = receiveIntoSpill(header.length, buffer);
+          if (offset == SIZE_MAX) {
+            problem = "could not store a spilled file";
+          } else {
+            received.push_back({header.offset, offset, header.length, false});
+          }
+          continue;
+        }
+        case StreamRecord::Pages:
+          if (header.offset > stagedSize || header.length > stagedSize - header.offset ||
+              header.length > stagedSize - stagedPages) {
+            problem = "page record outside the arena";
+            break;
+          }
+          stagedPages += header.length;
+          if (staged.size() + header.length > stagedLimit) {
+            const size_t offset = receiveIntoSpill(header.length, buffer);
+            if (offset == SIZE_MAX) {
+              problem = "could not stage pages in the spill file";
+            } else {
+              spooled.push_back({header.offset, offset, header.length});
+            }
+            continue;
+          }
+          break;
+        case StreamRecord::Apply:
+          if (header.length > maxApplyBytes) {
+            problem = "oversized table update";
+          }
+          break;
+        default:
+          problem = "unexpected record in the stream";
+      }
+      if (! problem.empty()) {
+        break;
+      }
+
+      const size_t start = staged.size();
+      staged.resize(start + sizeof(header) + header.length);
+      std::memcpy(staged.data() + start, &header, sizeof(header));
+      if (! recvAll(follower.socket, staged.data() + start + sizeof(header), header.length)) {
+        problem = "primary disconnected";
+        break;
+      }
+      if (header.type != StreamRecord::Apply) {
+        continue;
+      }
+
+      typename Sync::Lock gate(sync);
+      if (follower.promoted) {
+        break;
+      }
+      const bool applied = applyTransaction(staged, received, spooled, written);
+      touchWrittenFiles(written);
+      releaseReceivedSpills(received, spooled);
+      if (! applied) {
+        problem = "rejected transaction " + std::to_string(header.offset);
+        break;
+      }
+      staged.clear();
+      stagedSize = memorySize;
+      stagedPages = 0;
+      const StreamHeader ack = {StreamRecord::Ack, follower.applied, 0};
+      if (! sendAll(follower.socket, &ack, sizeof(ack))) {
+        problem = "primary disconnected";
+      }
+    }
+
+    typename Sync::Lock gate(sync);
+    releaseReceivedSpills(received, spooled);
+    follower.connected = false;
+    if (! follower.promoted) {
+      follower.problem = problem;
+    }
+  }
+
+  size_t receiveIntoSpill(size_t size, std::vector<uint8_t> &buffer) {
+    size_t offset = SIZE_MAX;
+    {
+      typename Sync::Lock gate(sync);
+      if (size == 0 || (! spill.isOpen() && ! spill.open(follower.path + ".spill"))) {
+        return SIZE_MAX;
+      }
+      offset = spill.allocate(size);
+      if (offset == SIZE_MAX) {
+        return SIZE_MAX;
+      }
+    }
+
+    buffer.resize(static_cast<size_t>(1) << 20);
+    for (size_t done = 0; done < size;) {
+      const size_t length = (std::min)(buffer.size(), size - done);
+      if (! recvAll(follower.socket, buffer.data(), length) || ! spill.write(offset + done, buffer.data(), length)) {
+        typename Sync::Lock gate(sync);
+        spill.release(offset, size);
+        return SIZE_MAX;
+      }
+      done += length;
+    }
+    return offset;
+  }
+
+  void touchWrittenFiles(std::vector<std::pair<size_t, size_t>> &written) {
+    std::sort(written.begin(), written.end());
+    for (auto &file: fileTable) {
+      if (file.isDirectory || file.size == 0 || file.spillState == SpillState::Spilled) {
+        continue;
+      }
+      auto next = std::lower_bound(written.begin(), written.end(), std::make_pair(file.offset + file.size, size_t{0}));
+      if (next != written.begin() && std::prev(next)->first + std::prev(next)->second > file.offset) {
+        file.generation = ++fileGeneration;
+      }
+    }
+    written.clear();
+  }
+
+  void releaseReceivedSpills(std::vector<ReceivedSpill> &received, std::vector<SpooledPages> &spooled) {
+    for (const auto &spilled: received) {
+      spill.release(spilled.offset, spilled.size);
+    }
+    for (const auto &pages: spooled) {
+      spill.release(pages.spillOffset, pages.length);
+    }
+    received.clear();
+    spooled.clear();
+  }
+
+  bool applyTransaction(const std::vector<uint8_t> &staged, std::vector<ReceivedSpill> &received,
+                        const std::vector<SpooledPages> &spooled, std::vector<std::pair<size_t, size_t>> &written) {
+    const uint8_t *cursor = staged.data();
+    const uint8_t *end = staged.data() + staged.size();
+    while (cursor < end) {
+      StreamHeader header;
+      std::memcpy(&header, cursor, sizeof(header));
+      cursor += sizeof(header);
+      switch (header.type) {
+        case StreamRecord::Begin:
+          if (! resetArena(header.length)) {
+            return false;
+          }
+          break;
+        case StreamRecord::Resize:
+          if (! reallocateMemory(header.length)) {
+            return false;
+          }
+          break;
+        case StreamRecord::Pages:
+          if (header.offset > memorySize || header.length > memorySize - header.offset) {
+            return false;
+          }
+          std::memcpy(memory + header.offset, cursor, header.length);
+          written.push_back({header.offset, header.length});
+          break;
+        case StreamRecord::Apply: {
+          for (const auto &pages: spooled) {
+            if (pages.offset > memorySize || pages.length > memorySize - pages.offset ||
+                ! spill.read(pages.spillOffset, memory + pages.offset, pages.length)) {
+              return false;
+            }
+            written.push_back({pages.offset, pages.length});
+          }
+          uint64_t sentAt = 0;
+          const uint8_t *payload = cursor;
+          const uint8_t *payloadEnd = cursor + header.length;
+          if (! readU64(payload, payloadEnd, sentAt) ||
+              (payload < payloadEnd && ! applyTableChanges(payload, payloadEnd, received))) {
+            return false;
+          }
+          follower.applied = header.offset;
+          follower.applyLag = (wallMicros() - static_cast<double>(sentAt)) / 1e6;
+          follower.lastApply = std::chrono::steady_clock::now();
+          break;
+        }
+        default:
+          return false;
+      }
+      cursor += header.type == StreamRecord::Pages || header.type == StreamRecord::Apply ? header.length : 0;
+    }
+    return true;
+  }
+
+  bool applyTableChanges(const uint8_t *cursor, const uint8_t *end, std::vector<ReceivedSpill> &received) {
+    ImageMetadata image;
+    uint64_t count = 0;
+    uint64_t updateCount = 0;
+    if (! readU64(cursor, end, image.memorySize) || ! readU64(cursor, end, image.dataStart) ||
+        ! readU64(cursor, end, image.currentDir) || ! readU64(cursor, end, image.defaultAlignment) ||
+        ! readU64(cursor, end, count) || ! readU64(cursor, end, updateCount) ||
+        image.memorySize != memorySize || updateCount > static_cast<uint64_t>(end - cursor) || count == 0 ||
+        count > fileTable.size() + updateCount) {
+      return false;
+    }
+
+    image.files.assign(fileTable.begin(), fileTable.begin() + (std::min)(fileTable.size(), static_cast<size_t>(count)));
+    image.files.resize(count);
+    std::vector<uint8_t> updated(count, 0);
+    for (uint64_t n = 0; n < updateCount; n++) {
+      uint64_t index = 0;
+      uint64_t spillOffset = 0;
+      if (! readU64(cursor, end, index) || index >= count || updated[index]) {
+        return false;
+      }
+      FileEntry &file = image.files[index];
+      file = FileEntry{};
+      if (! readEntry(cursor, end, file) || ! readU64(cursor, end, spillOffset)) {
+        return false;
+      }
+      if (spillOffset != SIZE_MAX) {
+        auto spilled = std::find_if(received.begin(), received.end(), [&](const ReceivedSpill &candidate) {
+          return candidate.index == index && candidate.size == file.size && ! candidate.used;
+        });
+        if (file.isDirectory || spilled == received.end()) {
+          return false;
+        }
+        spilled->used = true;
+        file.spillState = SpillState::Spilled;
+        file.spillOffset = spilled->offset;
+      }
+      updated[index] = 1;
+    }
+    if (cursor != end ||
+        std::find(updated.begin() + (std::min)(fileTable.size(), updated.size()), updated.end(), 0) != updated.end() ||
+        ! validateImage(image)) {
+      for (auto &spilled: received) {
+        spilled.used = false;
+      }
+      return false;
+    }
+
+    for (size_t i = 0; i < fileTable.size(); i++) {
+      if (i >= count || updated[i]) {
+        dropSpillCopy(fileTable[i]);
+      }
+    }
+    received.erase(std::remove_if(received.begin(), received.end(),
+                                  [](const ReceivedSpill &spilled) { return spilled.used; }),
+                   received.end());
+    const size_t localDir = currentDir;
+    applyMetadata(image);
+    if (localDir < fileTable.size() && fileTable[localDir].isDirectory) {
+      currentDir = localDir;
+    }
+    return true;
+  }
+
+  // Not joined here: the receiver may be waiting for the lock we hold.
+  void stopFollowing() {
+    follower.promoted = true;
+    shutdown(follower.listener, SD_BOTH);
+    if (follower.socket != INVALID_SOCKET) {
+      shutdown(follower.socket, SD_BOTH);
+    }
+  }
+
+  static bool isReadOnlyCommand(const std::string &command) {
+    static const std::set<std::string> commands = {
+        "help", "ls", "cd", "pwd", "cat", "df", "peek", "memsize", "env", "stats", "fragmap", "fsck",
+        "histogram", "entropy", "diff", "snapdiff", "export", "dump", "save", "replstatus", "promote", "serve", "exit"};
+    return commands.count(command) > 0 || command.compare(0, 5, "peek.") == 0;
+  }
+
+  void displayReplicationStatus() {
+    if (follower.readOnly || follower.connected) {
+      std::cout << "Replica of " << follower.path << ": "
+                << (follower.connected ? "connected" : "disconnected")
+                << (follower.problem.empty() ? "" : " (" + follower.problem + ")") << ", applied sequence "
+                << follower.applied;
+      if (follower.applied > 0) {
+        std::cout << ", apply lag " << formatDuration((std::max)(follower.applyLag, 0.0)) << ", last apply "
+                  << formatDuration(std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                                                  follower.lastApply).count())
+                  << " ago";
+      }
+      std::cout << "\n";
+      return;
+    }
+    if (replication.socket == INVALID_SOCKET) {
+      std::cout << "Replication is not active\n";
+      return;
+    }
+
+    std::lock_guard<std::mutex> guard(replication.mutex);
+    const double oldest = replication.inFlight.empty()
+                              ? 0
+                              : std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                                              replication.inFlight.begin()->second).count();
+    std::cout << "Replicating to " << replication.path << ": "
+              << (replication.active ? "connected" : "disconnected")
+              << (replication.problem.empty() ? "" : " (" + replication.problem + ")") << ", shipped "
+              << replication.shipped << ", acknowledged " << replication.acked << ", lag "
+              << replication.shipped - replication.acked << " commands / " << formatDuration(oldest)
+              << ", last round trip " << formatDuration(replication.ackLag) << ", queued "
+              << formatSize(replication.queuedBytes) << "\n";
+  }
+
+  static constexpr size_t httpHeaderLimit = 16 * 1024;
+  static constexpr size_t httpSendChunk = static_cast<size_t>(4) << 20;
+  static constexpr int httpIdleSeconds = 30;
+
+  void startServer(uint16_t port) {
+    if (! requireConcurrentBuild("The HTTP server")) {
+      return;
+    }
+    if (httpServer.loop.joinable()) {
+      std::cout << "Already serving on http://127.0.0.1:" << httpServer.port << "/\n";
+      return;
+    }
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    int length = sizeof(address);
+    u_long nonBlocking = 1;
+    SOCKET listener = startWinsock() ? ::socket(AF_INET, SOCK_STREAM, 0) : INVALID_SOCKET;
+    if (listener == INVALID_SOCKET ||
+        bind(listener, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == SOCKET_ERROR ||
+        listen(listener, SOMAXCONN) == SOCKET_ERROR || ioctlsocket(listener, FIONBIO, &nonBlocking) != 0 ||
+        getsockname(listener, reinterpret_cast<sockaddr *>(&address), &length) == SOCKET_ERROR) {
+      if (listener != INVALID_SOCKET) {
+        closesocket(listener);
+      }
+      std::cout << "Could not listen on 127.0.0.1:" << port << "\n";
+      return;
+    }
+
+    httpServer.listener = listener;
+    httpServer.port = ntohs(address.sin_port);
+    httpServer.stopping = false;
+    httpServer.requests = 0;
+    httpServer.bytesSent = 0;
+    httpServer.loop = std::thread([this] { serveLoop(); });
+    std::cout << "Serving http://127.0.0.1:" << httpServer.port << "/\n";
+  }
+
+  void stopServer() {
+    if (! httpServer.loop.joinable()) {
+      return;
+    }
+    httpServer.stopping = true;
+    httpServer.loop.join();
+    closesocket(httpServer.listener);
+    httpServer.listener = INVALID_SOCKET;
+  }
+
+  void displayServerStatus() {
+    if (! httpServer.loop.joinable()) {
+      std::cout << "Not serving\n";
+      return;
+    }
+    std::cout << "Serving http://127.0.0.1:" << httpServer.port << "/: " << httpServer.connections
+              << " connections, " << httpServer.requests << " requests, "
+              << formatSize(httpServer.bytesSent) << " sent\n";
+  }
+
+  void serveLoop() {
+    std::vector<HttpConnection> connections;
+    std::vector<WSAPOLLFD> polls;
+    while (! httpServer.stopping) {
+      polls.clear();
+      polls.push_back({httpServer.listener, POLLRDNORM, 0});
+      for (const auto &connection: connections) {
+        SHORT events = connection.input.size() < httpHeaderLimit * 4 ? POLLRDNORM : 0;
+        if (connection.outputSent < connection.output.size() || connection.bodyNext < connection.bodyEnd) {
+          events |= POLLWRNORM;
+        }
+        polls.push_back({connection.socket, events, 0});
+      }
+      if (WSAPoll(polls.data(), static_cast<ULONG>(polls.size()), 200) == SOCKET_ERROR) {
+        break;
+      }
+
+      const auto now = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < connections.size(); i++) {
+        HttpConnection &connection = connections[i];
+        const SHORT revents = polls[i + 1].revents;
+        if (revents & POLLRDNORM) {
+          char buffer[64 * 1024];
+          const int received = recv(connection.socket, buffer, sizeof(buffer), 0);
+          if (received > 0) {
+            connection.input.append(buffer, received);
+            connection.lastActive = now;
+          } else if (received == 0 || WSAGetLastError() != WSAEWOULDBLOCK) {
+            connection.closed = true;
+            continue;
+          }
+        } else if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+          connection.closed = true;
+          continue;
+        }
+        if (revents & POLLWRNORM) {
+          connection.lastActive = now;
+        }
+        connection.closed = ! serviceConnection(connection) ||
+                            now - connection.lastActive > std::chrono::seconds(httpIdleSeconds);
+      }
+
+      for (auto &connection: connections) {
+        if (connection.closed) {
+          closesocket(connection.socket);
+        }
+      }
+      connections.erase(std::remove_if(connections.begin(), connections.end(),
+                                       [](const HttpConnection &c) { return c.closed; }),
+                        connections.end());
+
+      if (polls[0].revents & POLLRDNORM) {
+        SOCKET socket;
+        while ((socket = accept(httpServer.listener, nullptr, nullptr)) != INVALID_SOCKET) {
+          u_long nonBlocking = 1;
+          int noDelay = 1;
+          ioctlsocket(socket, FIONBIO, &nonBlocking);
+          setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&noDelay), sizeof(noDelay));
+          HttpConnection connection;
+          connection.socket = socket;
+          connection.lastActive = now;
+          connections.push_back(std::move(connection));
+        }
+      }
+      httpServer.connections = connections.size();
+    }
+
+    for (auto &connection: connections) {
+      closesocket(connection.socket);
+    }
+    httpServer.connections = 0;
+  }
+
+  bool serviceConnection(HttpConnection &connection) {
+    while (true) {
+      if (! flushConnection(connection)) {
+        return false;
+      }
+      if (connection.outputSent < connection.output.size() || connection.bodyNext < connection.bodyEnd) {
+        return true;
+      }
+      if (connection.closeAfter) {
+        return false;
+      }
+
+      const size_t headerEnd = connection.input.find("\r\n\r\n");
+      if (headerEnd == std::string::npos) {
+        if (connection.input.size() > httpHeaderLimit) {
+          connection.closeAfter = true;
+          queueResponse(connection, 431, "Request Header Fields Too Large", "", "Header too large\n", false);
+          continue;
+        }
+        return true;
+      }
+      const std::string head = connection.input.substr(0, headerEnd);
+      connection.input.erase(0, headerEnd + 4);
+      typename Sync::Lock gate(sync);
+      handleRequest(connection, head);
+    }
+  }
+
+  bool flushConnection(HttpConnection &connection) {
+    while (true) {
+      if (connection.outputSent < connection.output.size()) {
+        const size_t length = (std::min)(connection.output.size() - connection.outputSent, httpSendChunk);
+        const int sent = send(connection.socket, connection.output.data() + connection.outputSent,
+                              static_cast<int>(length), 0);
+        if (sent == SOCKET_ERROR) {
+          return WSAGetLastError() == WSAEWOULDBLOCK;
+        }
+        connection.outputSent += sent;
+        httpServer.bytesSent += sent;
+        continue;
+      }
+      connection.output.clear();
+      connection.outputSent = 0;
+      if (connection.bodyNext >= connection.bodyEnd) {
+        return true;
+      }
+
+      // A file changed since the headers went out can no longer match them.
+      typename Sync::Lock gate(sync);
+      if (connection.file >= fileTable.size()) {
+        return false;
+      }
+      if (fileTable[connection.file].generation != connection.generation) {
+        return false;
+      }
+      const size_t length = (std::min)(connection.bodyEnd - connection.bodyNext, httpSendChunk);
+      if (connection.spilled) {
+        connection.output.resize((std::min)(length, static_cast<size_t>(1) << 20));
+        if (! spill.read(connection.extent + connection.bodyNext, reinterpret_cast<uint8_t *>(&connection.output[0]),
+                         connection.output.size())) {
+          return false;
+        }
+        connection.bodyNext += connection.output.size();
+        continue;
+      }
+      const int sent = send(connection.socket, reinterpret_cast<const char *>(memory + connection.extent +
+                                                                              connection.bodyNext),
+                            static_cast<int>(length), 0);
+      if (sent == SOCKET_ERROR) {
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+      }
+      connection.bodyNext += sent;
+      httpServer.bytesSent += sent;
+    }
+  }
+
+  void queueResponse(HttpConnection &connection, int status, const char *reason, const std::string &headers,
+                     const std::string &body, bool headOnly, size_t contentLength = SIZE_MAX) {
+    std::ostringstream out;
+    out << "HTTP/1.1 " << status << " " << reason << "\r\n"
+        << headers
+        << "Content-Length: " << (contentLength == SIZE_MAX ? body.size() : contentLength) << "\r\n"
+        << "Connection: " << (connection.closeAfter ? "close" : "keep-alive") << "\r\n\r\n";
+    connection.output += out.str();
+    if (! headOnly) {
+      connection.output += body;
+    }
+  }
+
+  // Multiple ranges are answered with the whole file, which RFC 9110 allows.
+  static bool parseRange(const std::string &spec, size_t size, size_t &first, size_t &last, bool &satisfiable) {
+    satisfiable = true;
+    if (spec.compare(0, 6, "bytes=") != 0 || spec.find(',') != std::string::npos) {
+      return false;
+    }
+    const size_t dash = spec.find('-', 6);
+    if (dash == std::string::npos) {
+      return false;
+    }
+    const std::string from = spec.substr(6, dash - 6);
+    const std::string to = spec.substr(dash + 1);
+    size_t a = 0;
+    size_t b = 0;
+    auto number = [](const std::string &text, size_t &value) {
+      const auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+      return ! text.empty() && result.ec == std::errc() && result.ptr == text.data() + text.size();
+    };
+    if (from.empty()) {
+      if (! number(to, b)) {
+        return false;
+      }
+      if (b == 0 || size == 0) {
+        satisfiable = false;
+        return true;
+      }
+      first = size - (std::min)(b, size);
+      last = size - 1;
+      return true;
+    }
+    if (! number(from, a) || (! to.empty() && (! number(to, b) || b < a))) {
+      return false;
+    }
+    if (a >= size) {
+      satisfiable = false;
+      return true;
+    }
+    first = a;
+    last = to.empty() ? size - 1 : (std::min)(b, size - 1);
+    return true;
+  }
+
+  void handleRequest(HttpConnection &connection, const std::string &head) {
+    std::istringstream lines(head);
+    std::string requestLine;
+    std::getline(lines, requestLine);
+    std::istringstream parts(requestLine);
+    std::string method;
+    std::string target;
+    std::string version;
+    parts >> method >> target >> version;
+    httpServer.requests++;
+
+    std::map<std::string, std::string> headers;
+    for (std::string line; std::getline(lines, line);) {
+      if (! line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+      const size_t colon = line.find(':');
+      if (colon == std::string::npos) {
+        continue;
+      }
+      std::string name = line.substr(0, colon);
+      std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+      const size_t value = line.find_first_not_of(" \t", colon + 1);
+      headers[name] = value == std::string::npos ? "" : line.substr(value);
+    }
+
+    std::string connectionHeader = headers["connection"];
+    std::transform(connectionHeader.begin(), connectionHeader.end(), connectionHeader.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    connection.closeAfter = version == "HTTP/1.1" ? connectionHeader == "close" : connectionHeader != "keep-alive";
+    // Request bodies are never read, so the connection ends after the response.
+    if (headers.count("transfer-encoding") > 0 ||
+        (headers.count("content-length") > 0 && headers["content-length"] != "0")) {
+      connection.closeAfter = true;
+    }
+    const bool headOnly = method == "HEAD";
+
+    if (version != "HTTP/1.1" && version != "HTTP/1.0") {
+      connection.closeAfter = true;
+      queueResponse(connection, 505, "HTTP Version Not Supported", "", "Unsupported HTTP version\n", false);
+      return;
+    }
+    if (method != "GET" && method != "HEAD") {
+      queueResponse(connection, 405, "Method Not Allowed", "Allow: GET, HEAD\r\n", "Method not allowed\n", headOnly);
+      return;
+    }
+    const std::string path = percentDecode(target.substr(0, target.find('?')));
+    if (path.empty() || path[0] != '/') {
+      queueResponse(connection, 400, "Bad Request", "", "Bad request target\n", headOnly);
+      return;
+    }
+    if (imageLoad.thread.joinable() && imageLoad.done < imageLoad.total) {
+      queueResponse(connection, 503, "Service Unavailable", "Retry-After: 1\r\n", "Image still loading\n", headOnly);
+      return;
+    }
+
+    size_t index = 0;
+    std::istringstream segments(path);
+    for (std::string segment; std::getline(segments, segment, '/');) {
+      if (segment.empty() || segment == ".") {
+        continue;
+      }
+      index = segment == ".." ? fileTable[index].parent
+                              : fileTable[index].isDirectory ? findFile(segment, index) : SIZE_MAX;
+      if (index == SIZE_MAX) {
+        queueResponse(connection, 404, "Not Found", "", "Not found\n", headOnly);
+        return;
+      }
+    }
+
+    if (fileTable[index].isDirectory) {
+      if (path.back() != '/') {
+        queueResponse(connection, 301, "Moved Permanently", "Location: " + target.substr(0, target.find('?')) + "/\r\n",
+                      "", headOnly);
+        return;
+      }
+      queueResponse(connection, 200, "OK", "Content-Type: text/html; charset=utf-8\r\n", listDirectory(index),
+                    headOnly);
+      return;
+    }
+    serveFile(connection, index, headers.count("range") > 0 ? headers["range"] : "", headOnly);
+  }
+
+  std::string listDirectory(size_t dir) {
+    std::vector<size_t> children;
+    for (size_t i = 1; i < fileTable.size(); i++) {
+      if (fileTable[i].parent == dir) {
+        children.push_back(i);
+      }
+    }
+    std::sort(children.begin(), children.end(),
+              [&](size_t a, size_t b) { return fileTable[a].name < fileTable[b].name; });
+
+    const std::string title = htmlEscape(dir == 0 ? "/" : getFullPath(dir) + "/");
+    std::ostringstream out;
+    out << "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>Index of " << title
+        << "</title></head>\n<body><h1>Index of " << title << "</h1><pre>\n";
+    if (dir != 0) {
+      out << "<a href=\"../\">../</a>\n";
+    }
+    for (size_t i: children) {
+      const FileEntry &entry = fileTable[i];
+      const std::string suffix = entry.isDirectory ? "/" : "";
+      const size_t width = entry.name.size() + suffix.size();
+      out << "<a href=\"" << percentEncode(entry.name) << suffix << "\">" << htmlEscape(entry.name + suffix) << "</a>"
+          << std::string(width < 40 ? 40 - width : 1, ' ')
+          << (entry.isDirectory ? std::string("-") : std::to_string(entry.size)) << "\n";
+    }
+    out << "</pre></body></html>\n";
+    return out.str();
+  }
+
+  void serveFile(HttpConnection &connection, size_t index, const std::string &range, bool headOnly) {
+    FileEntry &file = fileTable[index];
+    file.lastAccess = accessClock;
+    const bool resident = file.spillState != SpillState::Spilled;
+    if (resident) {
+      spillStats.residentHits++;
+    }
+
+    size_t first = 0;
+    size_t last = file.size - 1;
+    bool satisfiable = true;
+    const bool partial = ! range.empty() && parseRange(range, file.size, first, last, satisfiable);
+    if (! satisfiable) {
+      queueResponse(connection, 416, "Range Not Satisfiable", "Content-Range: bytes */" + std::to_string(file.size) + "\r\n",
+                    "", headOnly);
+      return;
+    }
+    const size_t length = file.size == 0 ? 0 : last - first + 1;
+
+    std::string headers = "Content-Type: application/octet-stream\r\nAccept-Ranges: bytes\r\n";
+    if (partial) {
+      headers += "Content-Range: bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" +
+                 std::to_string(file.size) + "\r\n";
+    }
+    queueResponse(connection, partial ? 206 : 200, partial ? "Partial Content" : "OK", headers, "", true, length);
+
+    connection.file = index;
+    connection.generation = file.generation;
+    connection.spilled = ! resident;
+    connection.extent = resident ? file.offset : file.spillOffset;
+    connection.bodyNext = first;
+    connection.bodyEnd = headOnly ? first : first + length;
+    if (resident && ! headOnly) {
+      recordAccess(file.offset + first, length);
+    }
+  }
+
+  void exportFile(size_t index, const std::string &hostPath) {
+    if (! faultIn(index)) {
+      std::cout << "Not enough arena space to load " << getFullPath(index) << "\n";
+      return;
+    }
+
+    const FileEntry &file = fileTable[index];
+    const size_t sector = 4096;
+    const uint8_t *data = memory + file.offset;
+    const bool direct = reinterpret_cast<uintptr_t>(data) % sector == 0;
+    const size_t body = direct ? file.size / sector * sector : file.size;
+
+    auto start = std::chrono::steady_clock::now();
+    HANDLE handle = CreateFileA(hostPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                                FILE_ATTRIBUTE_NORMAL |
+                                    (direct ? FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH : 0),
+                                nullptr);
+    if (handle == INVALID_HANDLE_VALUE) {
+      std::cout << "Could not create " << hostPath << "\n";
+      return;
+    }
+
+    bool ok = writeFileAt(handle, 0, data, body);
+    if (ok && body < file.size) {
+      auto *bounce = static_cast<uint8_t *>(_aligned_malloc(sector, sector));
+      std::fill_n(bounce, sector, 0);
+      std::copy_n(data + body, file.size - body, bounce);
+      ok = writeFileAt(handle, body, bounce, sector);
+      _aligned_free(bounce);
+    }
+    CloseHandle(handle);
+
+    if (ok && body < file.size) {
+      handle = CreateFileA(hostPath.c_str(), GENERIC_WRITE, 0, nullptr, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL, nullptr);
+      LARGE_INTEGER end;
+      end.QuadPart = static_cast<LONGLONG>(file.size);
+      ok = handle != INVALID_HANDLE_VALUE && SetFilePointerEx(handle, end, nullptr, FILE_BEGIN) &&
+           SetEndOfFile(handle);
+      if (handle != INVALID_HANDLE_VALUE) {
+        CloseHandle(handle);
+      }
+    }
+
+    if (! ok) {
+      std::cout << "Export to " << hostPath << " failed\n";
+      return;
+    }
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Exported " << formatSize(file.size) << " to " << hostPath << " in "
+              << formatDuration(seconds) << " (" << formatSize(static_cast<size_t>(file.size / (std::max)(seconds, 1e-9)))
+              << "/s, " << (direct ? "unbuffered" : "buffered, extent not 4k aligned") << ")\n";
+  }
+
+  bool faultIn(size_t index) {
+    FileEntry &file = fileTable[index];
+    if (file.spillState != SpillState::Spilled) {
+      return true;
+    }
+    if (follower.readOnly) {
+      return false;
+    }
+
+    const size_t offset = allocateResident(file.size, index);
+    if (offset == SIZE_MAX) {
+      return false;
+    }
+    if (! spill.read(file.spillOffset, memory + offset, file.size)) {
+      allocator.release(offset, file.size);
+      return false;
+    }
+
+    file.offset = offset;
+    file.spillState = SpillState::Clean;
+    file.generation = ++fileGeneration;
+    markDirty(offset, file.size);
+    spillStats.promotions++;
+    spillStats.bytesIn += file.size;
+    return true;
+  }
+
+  void scheduleWriteBack() {
+    if (! spill.isOpen() || fileTable.empty()) {
+      return;
+    }
+
+    for (size_t scanned = 0; scanned < 64 && scanned < fileTable.size(); scanned++) {
+      writeBackCursor = (writeBackCursor + 1) % fileTable.size();
+      FileEntry &file = fileTable[writeBackCursor];
+      if (file.isDirectory || file.size == 0 || file.spillState != SpillState::Resident ||
+          accessClock - file.lastAccess < coldAge) {
+        continue;
+      }
+
+      const size_t spillOffset = spill.allocate(file.size);
+      if (spillOffset == SIZE_MAX) {
+        return;
+      }
+      spill.writeAsync(spillOffset, memory + file.offset, file.size);
+      file.spillOffset = spillOffset;
+      file.spillState = SpillState::Cleaning;
+      spillStats.writeBacks++;
+      spillStats.bytesOut += file.size;
+    }
+  }
+
+  void displaySpillStatus() {
+    if (! spill.isOpen()) {
+      std::cout << "Spill tier off\n";
+      return;
+    }
+
+    size_t residentBytes = 0;
+    size_t spilledBytes = 0;
+    size_t spilledFiles = 0;
+    size_t cleanCopies = 0;
+    for (const auto &file: fileTable) {
+      if (file.isDirectory) {
+        continue;
+      }
+      if (file.spillState == SpillState::Spilled) {
+        spilledBytes += file.size;
+        spilledFiles++;
+      } else {
+        residentBytes += file.size;
+        cleanCopies += file.spillState != SpillState::Resident;
+      }
+    }
+
+    const uint64_t reads = spillStats.residentHits + spillStats.promotions;
+    std::cout << "Spill file " << spill.path() << ": " << formatSize(spill.used())
+              << " used of " << formatSize(spill.capacity()) << "\n"
+              << "Resident: " << formatSize(residentBytes) << " (" << cleanCopies
+              << " files with clean spill copies)\n"
+              << "Spilled: " << spilledFiles << " files, " << formatSize(spilledBytes) << "\n"
+              << "Demotions: " << spillStats.demotions << ", promotions: "
+              << spillStats.promotions << ", write-backs: " << spillStats.writeBacks
+              << ", writes placed in spill: " << spillStats.spilledWrites << "\n"
+              << "Traffic: " << formatSize(spillStats.bytesOut) << " out, "
+              << formatSize(spillStats.bytesIn) << " in\n"
+              << "Resident hit rate: "
+              << (reads == 0 ? 100.0 : 100.0 * spillStats.residentHits / reads) << "% ("
+              << "arena needed to hold everything: "
+              << formatSize(dataStart + residentBytes + spilledBytes) << ")\n";
+  }
+
+  bool allocateFile(size_t index, size_t newSize, bool allowSpill = false) {
+    FileEntry &file = fileTable[index];
+    const size_t oldSize = file.size;
+    const bool wasSpilled = file.spillState == SpillState::Spilled;
+
+    if (! chargeQuota(index, oldSize, newSize)) {
+      return false;
+    }
+    file.hostStamp = 0;
+
+    if (! wasSpilled) {
+      allocator.release(file.offset, oldSize);
+    }
+    size_t offset = newSize > 0 ? allocateResident(newSize, index) : 0;
+    if (offset == SIZE_MAX && allowSpill && spill.isOpen()) {
+      const size_t spillOffset = spill.allocate(newSize);
+      if (spillOffset != SIZE_MAX) {
+        dropSpillCopy(file);
+        file.spillState = SpillState::Spilled;
+        file.spillOffset = spillOffset;
+        file.size = newSize;
+        spillStats.spilledWrites++;
+        return true;
+      }
+    }
+    if (offset == SIZE_MAX) {
+      if (! wasSpilled) {
+        allocator.reserve(file.offset, oldSize);
+      }
+      chargeQuota(index, newSize, oldSize);
+      std::cout << "Not enough space.\n";
+      return false;
+    }
+
+    dropSpillCopy(file);
+    file.offset = offset;
+    file.size = newSize;
+    return true;
+  }
+
+  void loadEnvironmentVariables() {
+    LPWCH envStrings = GetEnvironmentStringsW();
+    if (envStrings != nullptr) {
+      LPWCH current = envStrings;
+      while (*current) {
+        std::wstring envPair(current);
+        size_t pos = envPair.find(L'=');
+        if (pos != std::wstring::npos) {
+          std::string name(envPair.begin(), envPair.begin() + pos);
+          std::string value(envPair.begin() + pos + 1, envPair.end());
+          envVars[name] = value;
+        }
+        current += wcslen(current) + 1;
+      }
+      FreeEnvironmentStringsW(envStrings);
+    }
+  }
+
+  bool reallocateMemory(size_t newSize) {
+    spill.drain();
+    try {
+      memory = backing.resize(memorySize, newSize);
+      memorySize = newSize;
+      accessHeat.assign(heatRegions, 0);
+      dirtyPages.resize((memorySize / trackedPageSize + 64) / 64, 0);
+      return true;
+    } catch (const std::bad_alloc &e) {
+      std::cerr << "Failed to allocate memory: " << e.what() << std::endl;
+      return false;
+    }
+  }
+
+  void recordAccess(size_t offset, size_t length) {
+    if (length == 0 || memorySize == 0) {
+      return;
+    }
+
+    const size_t first = offset / (memorySize / heatRegions + 1);
+    const size_t last = (offset + length - 1) / (memorySize / heatRegions + 1);
+    for (size_t region = first; region <= last && region < heatRegions; region++) {
+      accessHeat[region]++;
+    }
+  }
+
+  enum class FsckIssue {
+    BadRoot,
+    DanglingParent,
+    ParentNotDirectory,
+    Cycle,
+    EmptyName,
+    DuplicateName,
+    OutOfBounds,
+    Misaligned,
+    Overlap,
+    MarkedFree,
+    LeakedSpace,
+    LostSpillCopy,
+    StaleSpillCopy,
+    QuotaRoot,
+    QuotaUsage
+  };
+
+  struct FsckProblem {
+    FsckIssue issue;
+    size_t index;
+    size_t detail;
+  };
+
+  struct PackedEntry {
+    size_t offset;
+    size_t size;
+    size_t parent;
+    size_t nameHash;
+    bool isDirectory;
+    bool resident;
+  };
+
+  struct ExtentRef {
+    size_t offset;
+    size_t end;
+    size_t index;
+  };
+
+  static constexpr size_t fsckSlice = 1 << 16;
+
+  static size_t fsckThreads(size_t count) {
+    return (std::max)(static_cast<size_t>(1),
+                      (std::min)(static_cast<size_t>(std::thread::hardware_concurrency()), count / fsckSlice));
+  }
+
+  template <typename Work>
+  static void forEachSlice(size_t count, size_t threads, Work work) {
+    auto worker = [&](size_t thread) {
+      work(thread, count * thread / threads, count * (thread + 1) / threads);
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < threads; i++) {
+      workers.emplace_back(worker, i);
+    }
+    worker(0);
+    for (auto &thread: workers) {
+      thread.join();
+    }
+  }
+
+  template <typename T, typename Less>
+  static void parallelSort(std::vector<T> &items, size_t threads, Less less) {
+    forEachSlice(items.size(), threads, [&](size_t, size_t begin, size_t end) {
+      std::sort(items.begin() + begin, items.begin() + end, less);
+    });
+    auto bound = [&](size_t slice) {
+      return items.begin() + items.size() * (std::min)(slice, threads) / threads;
+    };
+    for (size_t width = 1; width < threads; width *= 2) {
+      std::vector<std::thread> merges;
+      for (size_t slice = 0; slice + width < threads; slice += 2 * width) {
+        merges.emplace_back([&, slice] {
+          std::inplace_merge(bound(slice), bound(slice + width), bound(slice + 2 * width), less);
+        });
+      }
+      for (auto &merge: merges) {
+        merge.join();
+      }
+    }
+  }
+
+  template <typename T>
+  static std::vector<T> concatenate(std::vector<std::vector<T>> &parts) {
+    size_t total = 0;
+    for (const auto &part: parts) {
+      total += part.size();
+    }
+    std::vector<T> result;
+    result.reserve(total);
+    for (auto &part: parts) {
+      result.insert(result.end(), part.begin(), part.end());
+      part = std::vector<T>();
+    }
+    return result;
+  }
+
+  std::vector<PackedEntry> packEntries(size_t threads) {
+    std::vector<PackedEntry> packed(fileTable.size());
+    forEachSlice(fileTable.size(), threads, [&](size_t, size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++) {
+        const FileEntry &file = fileTable[i];
+        packed[i] = {file.offset, file.size, file.parent, std::hash<std::string>()(file.name),
+                     file.isDirectory, file.spillState != SpillState::Spilled};
+      }
+    });
+    return packed;
+  }
+
+  void checkEntries(const std::vector<PackedEntry> &packed, size_t threads,
+                    std::vector<FsckProblem> &problems) {
+    std::vector<std::vector<FsckProblem>> found(threads);
+    forEachSlice(packed.size(), threads, [&](size_t thread, size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++) {
+        const PackedEntry &entry = packed[i];
+        const FileEntry &file = fileTable[i];
+        if (i == 0) {
+          if (! entry.isDirectory || entry.parent != 0) {
+            found[thread].push_back({FsckIssue::BadRoot, 0, 0});
+          }
+          continue;
+        }
+
+        if (entry.parent >= packed.size()) {
+          found[thread].push_back({FsckIssue::DanglingParent, i, entry.parent});
+        } else if (! packed[entry.parent].isDirectory) {
+          found[thread].push_back({FsckIssue::ParentNotDirectory, i, entry.parent});
+        }
+        if (file.name.empty()) {
+          found[thread].push_back({FsckIssue::EmptyName, i, 0});
+        }
+        if (entry.isDirectory || entry.size == 0) {
+          continue;
+        }
+        if (! entry.resident) {
+          if (! spill.isOpen() || file.spillOffset == SIZE_MAX ||
+              file.spillOffset + entry.size > spill.capacity()) {
+            found[thread].push_back({FsckIssue::LostSpillCopy, i, 0});
+          }
+        } else if (entry.offset < dataStart || entry.offset >= memorySize ||
+                   entry.size > memorySize - entry.offset) {
+          found[thread].push_back({FsckIssue::OutOfBounds, i, 0});
+        } else if (file.alignment > 0 && entry.offset % file.alignment != 0) {
+          found[thread].push_back({FsckIssue::Misaligned, i, file.alignment});
+        }
+      }
+    });
+    for (const auto &problem: concatenate(found)) {
+      problems.push_back(problem);
+    }
+  }
+
+  std::vector<size_t> walkTree(const std::vector<PackedEntry> &packed, std::vector<uint8_t> &reached) {
+    const size_t count = packed.size();
+    auto linked = [&](size_t i) {
+      return i != 0 && packed[i].parent < count && packed[packed[i].parent].isDirectory;
+    };
+
+    std::vector<size_t> first(count + 1, 0);
+    for (size_t i = 0; i < count; i++) {
+      if (linked(i)) {
+        first[packed[i].parent + 1]++;
+      }
+    }
+    for (size_t i = 0; i < count; i++) {
+      first[i + 1] += first[i];
+    }
+    std::vector<size_t> children(first[count]);
+    std::vector<size_t> fill(first.begin(), first.end() - 1);
+    for (size_t i = 0; i < count; i++) {
+      if (linked(i)) {
+        children[fill[packed[i].parent]++] = i;
+      }
+    }
+    fill = std::vector<size_t>();
+
+    reached.assign(count, 0);
+    std::vector<size_t> order;
+    order.reserve(count);
+    if (count > 0 && packed[0].isDirectory) {
+      order.push_back(0);
+      reached[0] = 1;
+    }
+    for (size_t next = 0; next < order.size(); next++) {
+      const size_t dir = order[next];
+      for (size_t c = first[dir]; c < first[dir + 1]; c++) {
+        if (! reached[children[c]]) {
+          reached[children[c]] = 1;
+          order.push_back(children[c]);
+        }
+      }
+    }
+    return order;
+  }
+
+  void findCycles(const std::vector<PackedEntry> &packed, const std::vector<uint8_t> &reached,
+                  std::vector<FsckProblem> &problems) {
+    const size_t count = packed.size();
+    std::vector<size_t> stamp;
+    for (size_t i = 1; i < count; i++) {
+      if (reached[i]) {
+        continue;
+      }
+      if (stamp.empty()) {
+        stamp.assign(count, SIZE_MAX);
+      }
+      size_t current = i;
+      while (current < count && ! reached[current] && stamp[current] == SIZE_MAX) {
+        stamp[current] = i;
+        const size_t parent = packed[current].parent;
+        if (parent >= count || ! packed[parent].isDirectory) {
+          current = SIZE_MAX;
+          break;
+        }
+        current = parent;
+      }
+      if (current < count && ! reached[current] && stamp[current] == i) {
+        problems.push_back({FsckIssue::Cycle, current, 0});
+      }
+    }
+  }
+
+  void checkNames(const std::vector<PackedEntry> &packed, size_t threads,
+                  std::vector<FsckProblem> &problems) {
+    struct NameKey {
+      size_t parent;
+      size_t hash;
+      size_t index;
+    };
+    std::vector<NameKey> keys(packed.size() > 0 ? packed.size() - 1 : 0);
+    forEachSlice(keys.size(), threads, [&](size_t, size_t begin, size_t end) {
+      for (size_t k = begin; k < end; k++) {
+        keys[k] = {packed[k + 1].parent, packed[k + 1].nameHash, k + 1};
+      }
+    });
+    parallelSort(keys, threads, [](const NameKey &a, const NameKey &b) {
+      return std::tie(a.parent, a.hash, a.index) < std::tie(b.parent, b.hash, b.index);
+    });
+
+    for (size_t group = 0; group < keys.size();) {
+      size_t end = group + 1;
+      while (end < keys.size() && keys[end].parent == keys[group].parent && keys[end].hash == keys[group].hash) {
+        end++;
+      }
+      for (size_t k = group + 1; k < end; k++) {
+        for (size_t earlier = group; earlier < k; earlier++) {
+          if (fileTable[keys[k].index].name == fileTable[keys[earlier].index].name) {
+            problems.push_back({FsckIssue::DuplicateName, keys[k].index, keys[earlier].index});
+            break;
+          }
+        }
+      }
+      group = end;
+    }
+  }
+
+  std::vector<ExtentRef> collectExtents(const std::vector<PackedEntry> &packed, size_t threads) {
+    std::vector<std::vector<ExtentRef>> found(threads);
+    forEachSlice(packed.size(), threads, [&](size_t thread, size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++) {
+        const PackedEntry &entry = packed[i];
+        if (! entry.isDirectory && entry.resident && entry.size > 0 && entry.offset >= dataStart &&
+            entry.offset < memorySize && entry.size <= memorySize - entry.offset) {
+          found[thread].push_back({entry.offset, entry.offset + entry.size, i});
+        }
+      }
+    });
+    std::vector<ExtentRef> extents = concatenate(found);
+    parallelSort(extents, threads, [](const ExtentRef &a, const ExtentRef &b) {
+      return a.offset < b.offset || (a.offset == b.offset && a.index < b.index);
+    });
+    return extents;
+  }
+
+  static void findOverlaps(const std::vector<ExtentRef> &extents, std::vector<FsckProblem> &problems) {
+    size_t reach = 0;
+    size_t owner = SIZE_MAX;
+    for (const auto &extent: extents) {
+      if (extent.offset < reach) {
+        problems.push_back({FsckIssue::Overlap, extent.index, owner});
+      }
+      if (extent.end > reach) {
+        reach = extent.end;
+        owner = extent.index;
+      }
+    }
+  }
+
+  // The live allocator must refuse every file extent.
+  void checkFreeSpace(const std::vector<ExtentRef> &extents, std::vector<FsckProblem> &problems) {
+    Allocator probe = allocator;
+    for (const auto &extent: extents) {
+      if (probe.reserve(extent.offset, extent.end - extent.offset)) {
+        problems.push_back({FsckIssue::MarkedFree, extent.index, 0});
+      }
+    }
+
+    // Buddy blocks round up, so the live allocator holds more than its files.
+    if constexpr (! std::is_same<Allocator, BuddyAllocator>::value) {
+      Allocator rebuilt;
+      rebuilt.reset(dataStart, memorySize);
+      for (const auto &extent: extents) {
+        rebuilt.reserve(extent.offset, extent.end - extent.offset);
+      }
+      if (rebuilt.freeBytes() > probe.freeBytes()) {
+        problems.push_back({FsckIssue::LeakedSpace, 0, rebuilt.freeBytes() - probe.freeBytes()});
+      }
+    }
+  }
+
+  void checkSpillCopies(std::vector<FsckProblem> &problems) {
+    if (! spill.isOpen()) {
+      return;
+    }
+    spill.drain();
+    std::vector<uint8_t> buffer;
+    for (size_t i = 0; i < fileTable.size(); i++) {
+      const FileEntry &file = fileTable[i];
+      if (file.isDirectory || file.spillState != SpillState::Clean || file.spillOffset == SIZE_MAX ||
+          file.offset < dataStart || file.offset >= memorySize || file.size > memorySize - file.offset) {
+        continue;
+      }
+      buffer.resize((std::min)(file.size, static_cast<size_t>(1) << 20));
+      for (size_t done = 0; done < file.size; done += buffer.size()) {
+        const size_t length = (std::min)(buffer.size(), file.size - done);
+        if (! spill.read(file.spillOffset + done, buffer.data(), length) ||
+            std::memcmp(buffer.data(), memory + file.offset + done, length) != 0) {
+          problems.push_back({FsckIssue::StaleSpillCopy, i, 0});
+          break;
+        }
+      }
+    }
+  }
+
+  void checkQuotas(const std::vector<size_t> &order, std::vector<size_t> &expectedRoot,
+                   std::vector<size_t> &expectedUsed, std::vector<FsckProblem> &problems) {
+    expectedRoot.assign(fileTable.size(), SIZE_MAX);
+    expectedUsed.assign(fileTable.size(), 0);
+    for (size_t i: order) {
+      if (i != 0) {
+        const size_t parent = fileTable[i].parent;
+        expectedRoot[i] = fileTable[parent].quota > 0 ? parent : expectedRoot[parent];
+      }
+    }
+    for (size_t i: order) {
+      if (! fileTable[i].isDirectory) {
+        for (size_t r = expectedRoot[i]; r != SIZE_MAX; r = expectedRoot[r]) {
+          expectedUsed[r] += fileTable[i].size;
+        }
+      }
+    }
+    for (size_t i: order) {
+      const FileEntry &entry = fileTable[i];
+      if (entry.quotaRoot != expectedRoot[i]) {
+        problems.push_back({FsckIssue::QuotaRoot, i, expectedRoot[i]});
+      }
+      if (entry.isDirectory && entry.quotaUsed != expectedUsed[i]) {
+        problems.push_back({FsckIssue::QuotaUsage, i, expectedUsed[i]});
+      }
+    }
+  }
+
+  struct FsckState {
+    std::vector<FsckProblem> problems;
+    std::vector<uint8_t> reached;
+    std::vector<size_t> order;
+  };
+
+  FsckState checkFileSystem(size_t threads) {
+    FsckState state;
+    std::vector<PackedEntry> packed = packEntries(threads);
+    checkEntries(packed, threads, state.problems);
+    state.order = walkTree(packed, state.reached);
+    findCycles(packed, state.reached, state.problems);
+    checkNames(packed, threads, state.problems);
+
+    const std::vector<ExtentRef> extents = collectExtents(packed, threads);
+    packed = std::vector<PackedEntry>();
+    const size_t overlapsBefore = state.problems.size();
+    findOverlaps(extents, state.problems);
+    if (state.problems.size() == overlapsBefore) {
+      checkFreeSpace(extents, state.problems);
+    }
+    checkSpillCopies(state.problems);
+    std::vector<size_t> expectedRoot;
+    std::vector<size_t> expectedUsed;
+    checkQuotas(state.order, expectedRoot, expectedUsed, state.problems);
+    return state;
+  }
+
+  std::string describeEntry(size_t index, const std::vector<uint8_t> &reached) {
+    if (index < reached.size() && reached[index] && (index == 0 || ! fileTable[index].name.empty())) {
+      return getFullPath(index);
+    }
+    if (index < fileTable.size()) {
+      return "#" + std::to_string(index) + " '" + fileTable[index].name + "'";
+    }
+    return "#" + std::to_string(index);
+  }
+
+  std::string describeProblem(const FsckProblem &problem, const std::vector<uint8_t> &reached) {
+    const FileEntry &file = fileTable[problem.index];
+    switch (problem.issue) {
+      case FsckIssue::BadRoot:
+        return "/: root is not a directory at the top of the tree";
+      case FsckIssue::DanglingParent:
+        return describeEntry(problem.index, reached) + ": parent #" + std::to_string(problem.detail) +
+               " does not exist";
+      case FsckIssue::ParentNotDirectory:
+        return describeEntry(problem.index, reached) + ": parent " + describeEntry(problem.detail, reached) +
+               " is not a directory";
+      case FsckIssue::Cycle:
+        return describeEntry(problem.index, reached) + ": parent chain loops back on itself";
+      case FsckIssue::EmptyName:
+        return describeEntry(problem.index, reached) + ": empty name";
+      case FsckIssue::DuplicateName:
+        return describeEntry(problem.index, reached) + ": same name as #" + std::to_string(problem.detail);
+      case FsckIssue::OutOfBounds:
+        return describeEntry(problem.index, reached) + ": extent " + std::to_string(file.offset) + " +" +
+               std::to_string(file.size) + " lies outside the data area";
+      case FsckIssue::Misaligned:
+        return describeEntry(problem.index, reached) + ": offset " + std::to_string(file.offset) +
+               " is not " + alignmentName(problem.detail) + " aligned";
+      case FsckIssue::Overlap:
+        return describeEntry(problem.index, reached) + ": extent " + std::to_string(file.offset) + " +" +
+               std::to_string(file.size) + " overlaps " + describeEntry(problem.detail, reached);
+      case FsckIssue::MarkedFree:
+        return describeEntry(problem.index, reached) + ": extent is free in the allocator";
+      case FsckIssue::LeakedSpace:
+        return formatSize(problem.detail) + " allocated but owned by no file";
+      case FsckIssue::LostSpillCopy:
+        return describeEntry(problem.index, reached) + ": spilled without a spill copy";
+      case FsckIssue::StaleSpillCopy:
+        return describeEntry(problem.index, reached) + ": clean spill copy differs from the arena";
+      case FsckIssue::QuotaRoot:
+        return describeEntry(problem.index, reached) + ": charged to " +
+               (file.quotaRoot == SIZE_MAX ? std::string("no quota") : describeEntry(file.quotaRoot, reached)) +
+               " instead of " +
+               (problem.detail == SIZE_MAX ? std::string("no quota") : describeEntry(problem.detail, reached));
+      case FsckIssue::QuotaUsage:
+        return describeEntry(problem.index, reached) + ": " + formatSize(file.quotaUsed) +
+               " charged, contents total " + formatSize(problem.detail);
+    }
+    return "";
+  }
+
+  void displayFsckProblems(const FsckState &state) {
+    static constexpr size_t shownPerIssue = 10;
+    std::map<FsckIssue, size_t> shown;
+    for (const auto &problem: state.problems) {
+      const size_t seen = shown[problem.issue]++;
+      if (seen < shownPerIssue) {
+        std::cout << "  " << describeProblem(problem, state.reached) << "\n";
+      }
+    }
+    for (const auto &issue: shown) {
+      if (issue.second > shownPerIssue) {
+        std::cout << "  ... " << issue.second - shownPerIssue << " more like "
+                  << describeProblem(*std::find_if(state.problems.begin(), state.problems.end(),
+                                                   [&](const FsckProblem &p) { return p.issue == issue.first; }),
+                                     state.reached)
+                  << "\n";
+      }
+    }
+  }
+
+  size_t lostAndFound() {
+    for (size_t i = 1; i < fileTable.size(); i++) {
+      if (fileTable[i].parent == 0 && fileTable[i].isDirectory && fileTable[i].name == "lost+found") {
+        return i;
+      }
+    }
+    return createFile("lost+found", 0, true);
+  }
+
+  void repairFileSystem(FsckState &state, size_t threads) {
+    spill.drain();
+    std::vector<FsckProblem> problems = state.problems;
+    auto has = [&](std::initializer_list<FsckIssue> issues) {
+      return std::any_of(problems.begin(), problems.end(), [&](const FsckProblem &p) {
+        return std::find(issues.begin(), issues.end(), p.issue) != issues.end();
+      });
+    };
+
+    if (has({FsckIssue::BadRoot})) {
+      fileTable[0].isDirectory = true;
+      fileTable[0].parent = 0;
+      fileTable[0].size = 0;
+    }
+    const size_t lost = has({FsckIssue::DanglingParent, FsckIssue::ParentNotDirectory, FsckIssue::Cycle})
+                            ? lostAndFound() : SIZE_MAX;
+    for (const auto &problem: problems) {
+      FileEntry &file = fileTable[problem.index];
+      switch (problem.issue) {
+        case FsckIssue::DanglingParent:
+        case FsckIssue::ParentNotDirectory:
+        case FsckIssue::Cycle:
+          file.parent = lost;
+          break;
+        case FsckIssue::EmptyName:
+          file.name = "#" + std::to_string(problem.index);
+          break;
+        case FsckIssue::OutOfBounds:
+          file.size = file.offset >= dataStart && file.offset < memorySize ? memorySize - file.offset : 0;
+          file.offset = file.size > 0 ? file.offset : 0;
+          file.hostStamp = 0;
+          file.generation = ++fileGeneration;
+          break;
+        case FsckIssue::LostSpillCopy:
+          file.spillState = SpillState::Resident;
+          file.spillOffset = SIZE_MAX;
+          file.offset = 0;
+          file.size = 0;
+          file.hostStamp = 0;
+          file.generation = ++fileGeneration;
+          break;
+        case FsckIssue::StaleSpillCopy:
+          dropSpillCopy(file);
+          break;
+        default:
+          break;
+      }
+    }
+
+    std::vector<PackedEntry> packed = packEntries(threads);
+    problems.clear();
+    checkNames(packed, threads, problems);
+    if (! problems.empty()) {
+      std::unordered_map<size_t, std::set<std::string>> siblings;
+      for (const auto &problem: problems) {
+        siblings[fileTable[problem.index].parent];
+      }
+      for (const auto &file: fileTable) {
+        auto it = siblings.find(file.parent);
+        if (it != siblings.end()) {
+          it->second.insert(file.name);
+        }
+      }
+      for (const auto &problem: problems) {
+        FileEntry &file = fileTable[problem.index];
+        auto &taken = siblings[file.parent];
+        std::string name;
+        for (size_t n = 1; name.empty() || taken.count(name) > 0; n++) {
+          name = file.name + "~" + std::to_string(n);
+        }
+        taken.insert(name);
+        file.name = name;
+        packed[problem.index].nameHash = std::hash<std::string>()(name);
+      }
+    }
+
+    std::vector<ExtentRef> extents = collectExtents(packed, threads);
+    packed = std::vector<PackedEntry>();
+    problems.clear();
+    findOverlaps(extents, problems);
+    std::set<size_t> moved;
+    for (const auto &problem: problems) {
+      moved.insert(problem.index);
+    }
+    std::vector<std::pair<size_t, std::vector<uint8_t>>> saved;
+    for (size_t index: moved) {
+      const FileEntry &file = fileTable[index];
+      saved.push_back({index, std::vector<uint8_t>(memory + file.offset, memory + file.offset + file.size)});
+    }
+    allocator.reset(dataStart, memorySize);
+    for (const auto &extent: extents) {
+      if (moved.count(extent.index) == 0) {
+        allocator.reserve(extent.offset, extent.end - extent.offset);
+      }
+    }
+    extents = std::vector<ExtentRef>();
+    for (auto &copy: saved) {
+      FileEntry &file = fileTable[copy.first];
+      const size_t offset = allocator.allocate(file.size, alignmentFor(copy.first));
+      dropSpillCopy(file);
+      file.hostStamp = 0;
+      if (offset == SIZE_MAX) {
+        std::cout << "No space to move " << getFullPath(copy.first) << " off its overlap; truncated\n";
+        file.offset = 0;
+        file.size = 0;
+        continue;
+      }
+      std::memcpy(memory + offset, copy.second.data(), file.size);
+      markDirty(offset, file.size);
+      file.offset = offset;
+    }
+    saved.clear();
+
+    for (const auto &problem: state.problems) {
+      if (problem.issue == FsckIssue::Misaligned && ! relocateFile(problem.index)) {
+        std::cout << "No space to realign " << getFullPath(problem.index) << "\n";
+      }
+    }
+
+    packed = packEntries(threads);
+    std::vector<uint8_t> reached;
+    const std::vector<size_t> order = walkTree(packed, reached);
+    packed = std::vector<PackedEntry>();
+    problems.clear();
+    std::vector<size_t> expectedRoot;
+    std::vector<size_t> expectedUsed;
+    checkQuotas(order, expectedRoot, expectedUsed, problems);
+    for (size_t i: order) {
+      fileTable[i].quotaRoot = expectedRoot[i];
+      if (fileTable[i].isDirectory) {
+        fileTable[i].quotaUsed = expectedUsed[i];
+      }
+    }
+
+    directoryIndex.rebuild(fileTable);
+    if (currentDir >= fileTable.size() || ! reached[currentDir]) {
+      currentDir = 0;
+    }
+  }
+
+  void runFsck(bool repair) {
+    auto start = std::chrono::steady_clock::now();
+    const size_t threads = fsckThreads(fileTable.size());
+    FsckState state = checkFileSystem(threads);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    displayFsckProblems(state);
+    std::cout << "Checked " << fileTable.size() << " entries in " << formatDuration(seconds) << " on "
+              << threads << (threads == 1 ? " thread: " : " threads: ") << state.problems.size()
+              << (state.problems.size() == 1 ? " problem" : " problems");
+    if (state.problems.empty() || ! repair) {
+      std::cout << (state.problems.empty() || repair ? "" : "; run fsck -r to repair") << "\n";
+      return;
+    }
+    std::cout << "\n";
+
+    start = std::chrono::steady_clock::now();
+    repairFileSystem(state, threads);
+    const FsckState after = checkFileSystem(fsckThreads(fileTable.size()));
+    displayFsckProblems(after);
+    std::cout << "Repaired in " << formatDuration(std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                                                                start).count())
+              << ", " << after.problems.size() << " left\n";
+  }
+
+  void displayFragmap() {
+    const size_t cellSize = memorySize / heatRegions + 1;
+    std::vector<size_t> cellUsed(heatRegions, 0);
+    std::vector<size_t> freeBuckets(64, 0);
+    size_t freeTotal = 0;
+    size_t freeExtents = 0;
+    size_t largestFree = 0;
+
+    auto addFree = [&](size_t begin, size_t end) {
+      if (end <= begin) {
+        return;
+      }
+      const size_t length = end - begin;
+      size_t bucket = 0;
+      while ((length >> (bucket + 1)) != 0) {
+        bucket++;
+      }
+      freeBuckets[bucket]++;
+      freeTotal += length;
+      freeExtents++;
+      largestFree = (std::max)(largestFree, length);
+    };
+
+    size_t current = dataStart;
+    for (const auto &range: collectUsedRanges()) {
+      addFree(current, range.first);
+      current = (std::max)(current, range.second);
+
+      for (size_t cell = range.first / cellSize;
+           cell < heatRegions && cell * cellSize < range.second; cell++) {
+        const size_t begin = (std::max)(range.first, cell * cellSize);
+        const size_t end = (std::min)(range.second, (cell + 1) * cellSize);
+        cellUsed[cell] += end - begin;
+      }
+    }
+    addFree(current, memorySize);
+
+    std::cout << "Arena map (" << formatSize(cellSize) << " per cell, "
+              << "M=metadata #=full +=mostly used :=partly used .=free):\n";
+    for (size_t cell = 0; cell < heatRegions; cell++) {
+      const size_t cellBegin = cell * cellSize;
+      const size_t cellEnd = (std::min)(memorySize, cellBegin + cellSize);
+      char mark = '.';
+      if (cellBegin < dataStart) {
+        mark = 'M';
+      } else if (cellEnd > cellBegin && cellUsed[cell] >= cellEnd - cellBegin) {
+        mark = '#';
+      } else if (cellUsed[cell] * 2 >= cellSize) {
+        mark = '+';
+      } else if (cellUsed[cell] > 0) {
+        mark = ':';
+      }
+      std::cout << mark << ((cell + 1) % fragmapWidth == 0 ? "\n" : "");
+    }
+
+    static const char heatScale[] = " .:-=+*#%@";
+    const uint64_t hottest = *std::max_element(accessHeat.begin(), accessHeat.end());
+    std::cout << "\nAccess heat from cat/write (hottest region: " << hottest
+              << " accesses):\n";
+    for (size_t cell = 0; cell < heatRegions; cell++) {
+      const size_t level = hottest == 0 ? 0 : (accessHeat[cell] * 9 + hottest - 1) / hottest;
+      std::cout << heatScale[level] << ((cell + 1) % fragmapWidth == 0 ? "\n" : "");
+    }
+
+    std::cout << "\nFree extents: " << freeExtents << ", total "
+              << formatSize(freeTotal) << ", largest " << formatSize(largestFree);
+    if (freeTotal > 0) {
+      std::ostringstream oss;
+      oss << std::fixed << std::setprecision(1)
+          << 100.0 * (1.0 - static_cast<double>(largestFree) / freeTotal);
+      std::cout << ", fragmentation " << oss.str() << "%";
+    }
+    std::cout << "\n";
+
+    for (size_t bucket = 0; bucket < freeBuckets.size(); bucket++) {
+      if (freeBuckets[bucket] > 0) {
+        std::cout << "  >= " << std::setw(12) << formatSize(1ULL << bucket)
+                  << ": " << freeBuckets[bucket] << "\n";
+      }
+    }
+  }
+
+  std::pair<size_t, size_t> largestFreeExtent() {
+    std::pair<size_t, size_t> best = {dataStart, 0};
+    size_t current = dataStart;
+    for (const auto &range: collectUsedRanges()) {
+      if (range.first > current && range.first - current > best.second) {
+        best = {current, range.first - current};
+      }
+      current = (std::max)(current, range.second);
+    }
+    if (memorySize > current && memorySize - current > best.second) {
+      best = {current, memorySize - current};
+    }
+    return best;
+  }
+
+  static void pinToNode(DWORD_PTR affinity) {
+    if (affinity != 0) {
+      SetThreadAffinityMask(GetCurrentThread(), affinity);
+    }
+  }
+
+  double measureBandwidth(uint8_t *base, size_t size, size_t threads, int kind,
+                          DWORD_PTR affinity) {
+    const size_t slice = (size / threads) & ~static_cast<size_t>(63);
+    double best = 0;
+
+    for (int pass = 0; pass < 3; pass++) {
+      std::vector<std::thread> workers;
+      std::vector<uint64_t> sinks(threads, 0);
+      auto start = std::chrono::steady_clock::now();
+
+      for (size_t t = 0; t < threads; t++) {
+        workers.emplace_back([=, &sinks] {
+          pinToNode(affinity);
+          uint8_t *begin = base + t * slice;
+          if (kind == 0) {
+            const uint64_t *words = reinterpret_cast<const uint64_t *>(begin);
+            uint64_t a = 0, b = 0, c = 0, d = 0;
+            for (size_t i = 0; i + 4 <= slice / 8; i += 4) {
+              a += words[i];
+              b += words[i + 1];
+              c += words[i + 2];
+              d += words[i + 3];
+            }
+            sinks[t] = a + b + c + d;
+          } else if (kind == 1) {
+            std::memset(begin, pass + 1, slice);
+          } else {
+            std::memcpy(begin + slice / 2, begin, slice / 2);
+          }
+        });
+      }
+      for (auto &worker: workers) {
+        worker.join();
+      }
+
+      const double seconds = std::chrono::duration<double>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count();
+      const double bytes = static_cast<double>(slice) * threads;
+      best = (std::max)(best, bytes / seconds / 1e9);
+    }
+    return best;
+  }
+
+  double measureLatency(uint8_t *base, size_t size, DWORD_PTR affinity) {
+    const size_t lines = size / 64;
+    std::vector<size_t> order(lines);
+    for (size_t i = 0; i < lines; i++) {
+      order[i] = i;
+    }
+    std::shuffle(order.begin() + 1, order.end(), std::mt19937_64(42));
+    for (size_t i = 0; i < lines; i++) {
+      const size_t next = order[(i + 1) % lines] * 64;
+      std::memcpy(base + order[i] * 64, &next, sizeof(next));
+    }
+
+    double nanoseconds = 0;
+    std::thread chaser([&] {
+      pinToNode(affinity);
+      const size_t steps = 1 << 22;
+      size_t position = 0;
+      auto start = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < steps; i++) {
+        position = *reinterpret_cast<const size_t *>(base + position);
+      }
+      nanoseconds = std::chrono::duration<double, std::nano>(
+                        std::chrono::steady_clock::now() - start)
+                        .count() /
+                    steps;
+      volatile size_t sink = position;
+      (void) sink;
+    });
+    chaser.join();
+    return nanoseconds;
+  }
+
+  void runMemoryBenchmark(size_t maxThreads, size_t requestedSize) {
+    const auto region = largestFreeExtent();
+    const size_t size = (std::min)(region.second, requestedSize) &
+                        ~static_cast<size_t>(4095);
+    if (size < 64 * 1024 * maxThreads) {
+      std::cout << "Not enough free arena space for membench.\n";
+      return;
+    }
+    uint8_t *base = memory + region.first;
+
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    ULONG highestNode = 0;
+    GetNumaHighestNodeNumber(&highestNode);
+    const size_t largePage = GetLargePageMinimum();
+
+    std::cout << "Benchmarking " << formatSize(size) << " of free arena at offset "
+              << region.first << "\n"
+              << "Page size: " << formatSize(info.dwPageSize) << ", large pages: "
+              << (largePage > 0 ? formatSize(largePage) : std::string("unavailable"))
+              << ", NUMA nodes: " << highestNode + 1 << "\n"
+              << "The arena is backed by " << formatSize(info.dwPageSize)
+              << " pages, so every figure below is for that page size; large pages are not measured\n";
+
+    for (ULONG node = 0; node <= highestNode; node++) {
+      ULONGLONG nodeMask = 0;
+      if (highestNode > 0 && ! GetNumaNodeProcessorMask(static_cast<UCHAR>(node), &nodeMask)) {
+        continue;
+      }
+      const DWORD_PTR affinity = static_cast<DWORD_PTR>(nodeMask);
+
+      std::cout << "\nNode " << node << " (" << formatSize(info.dwPageSize)
+                << " pages)\n"
+                << "Threads   Read GB/s  Write GB/s   Copy GB/s\n";
+      std::vector<size_t> threadCounts;
+      for (size_t threads = 1; threads < maxThreads; threads *= 2) {
+        threadCounts.push_back(threads);
+      }
+      threadCounts.push_back(maxThreads);
+
+      for (size_t threads: threadCounts) {
+        std::ostringstream row;
+        row << std::fixed << std::setprecision(2) << std::setw(7) << threads
+            << std::setw(12) << measureBandwidth(base, size, threads, 0, affinity)
+            << std::setw(12) << measureBandwidth(base, size, threads, 1, affinity)
+            << std::setw(12) << measureBandwidth(base, size, threads, 2, affinity);
+        std::cout << row.str() << "\n";
       }
+
+      std::ostringstream latency;
+      latency << std::fixed << std::setprecision(1)
+              << measureLatency(base, size, affinity);
+      std::cout << "Random access latency: " << latency.str() << " ns\n";
     }
 
-    return SIZE_MAX;
+    std::memset(base, 0, size);
+    markDirty(region.first, size);
   }
 
-  void loadEnvironmentVariables() {
-    LPWCH envStrings = GetEnvironmentStringsW();
-    if (envStrings != nullptr) {
-      LPWCH current = envStrings;
-      while (*current) {
-        std::wstring envPair(current);
-        size_t pos = envPair.find(L'=');
-        if (pos != std::wstring::npos) {
-          std::string name(envPair.begin(), envPair.begin() + pos);
-          std::string value(envPair.begin() + pos + 1, envPair.end());
-          envVars[name] = value;
-        }
-        current += wcslen(current) + 1;
+  std::vector<TraceOp> generateChurnTrace(size_t operations, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    auto logUniform = [&](double low, double high) {
+      return static_cast<size_t>(std::exp(std::log(low) + uniform(rng) * (std::log(high) - std::log(low))));
+    };
+
+    std::vector<TraceOp> trace;
+    std::vector<size_t> live;
+    size_t nextId = 0;
+    trace.reserve(operations);
+
+    for (size_t i = 0; i < operations; i++) {
+      const double allocateChance = live.size() < 8000 ? 0.55 : 0.45;
+      if (live.empty() || uniform(rng) < allocateChance) {
+        const double kind = uniform(rng);
+        const size_t size = kind < 0.70   ? logUniform(16, 4096)
+                            : kind < 0.95 ? logUniform(4096, 256 * 1024)
+                                          : logUniform(256 * 1024, 8 * 1024 * 1024);
+        trace.push_back({true, nextId, size});
+        live.push_back(nextId++);
+      } else {
+        const size_t pick = static_cast<size_t>(uniform(rng) * live.size()) % live.size();
+        trace.push_back({false, live[pick], 0});
+        live[pick] = live.back();
+        live.pop_back();
       }
-      FreeEnvironmentStringsW(envStrings);
     }
+    return trace;
   }
 
-  bool reallocateMemory(size_t newSize) {
-    try {
-      std::unique_ptr<uint8_t[]> newMemory =
-          std::make_unique<uint8_t[]>(newSize);
-      std::fill_n(newMemory.get(), newSize, 0);
+  template <typename Strategy>
+  void benchmarkAllocator(const char *name, const std::vector<TraceOp> &trace) {
+    Strategy strategy;
+    strategy.reset(dataStart, memorySize);
 
-      if (memory) {
-        const size_t copySize = (std::min)(memorySize, newSize);
-        std::copy_n(memory.get(), copySize, newMemory.get());
-      }
+    std::vector<std::pair<size_t, size_t>> live(trace.size(), {SIZE_MAX, 0});
+    size_t failures = 0;
+    size_t liveBytes = 0;
+    size_t peakLive = 0;
+    size_t peakEnd = dataStart;
 
-      memory = std::move(newMemory);
-      memorySize = newSize;
-      return true;
-    } catch (const std::bad_alloc &e) {
-      std::cerr << "Failed to allocate memory: " << e.what() << std::endl;
-      return false;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto &op: trace) {
+      auto &slot = live[op.id];
+      if (op.allocate) {
+        const size_t offset = strategy.allocate(op.size);
+        if (offset == SIZE_MAX) {
+          failures++;
+          continue;
+        }
+        slot = {offset, op.size};
+        liveBytes += op.size;
+        peakLive = (std::max)(peakLive, liveBytes);
+        peakEnd = (std::max)(peakEnd, offset + op.size);
+      } else if (slot.first != SIZE_MAX) {
+        strategy.release(slot.first, slot.second);
+        liveBytes -= slot.second;
+        slot.first = SIZE_MAX;
+      }
     }
+    const double seconds = std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+
+    const size_t freeBytes = strategy.freeBytes();
+    const double fragmentation =
+        freeBytes == 0 ? 0.0 : 100.0 * (1.0 - static_cast<double>(strategy.largestFree()) / freeBytes);
+    std::ostringstream row;
+    row << std::left << std::setw(11) << name << std::right << std::fixed
+        << std::setprecision(2) << std::setw(10) << trace.size() / seconds / 1e6
+        << std::setw(10) << failures << std::setw(14) << formatSize(peakEnd - dataStart)
+        << std::setw(14) << formatSize(peakLive) << std::setprecision(1)
+        << std::setw(11) << fragmentation << "%";
+    std::cout << row.str() << "\n";
+  }
+
+  void runAllocatorBenchmark(size_t operations, uint64_t seed) {
+    const auto trace = generateChurnTrace(operations, seed);
+    std::cout << "Replaying " << trace.size() << " operations over "
+              << formatSize(memorySize - dataStart) << " (seed " << seed << ")\n"
+              << "Strategy      Mops/s  Failures     Footprint     Peak live  Fragment.\n";
+    benchmarkAllocator<FirstFitAllocator>("first-fit", trace);
+    benchmarkAllocator<BestFitAllocator>("best-fit", trace);
+    benchmarkAllocator<BuddyAllocator>("buddy", trace);
+    benchmarkAllocator<BitmapAllocator>("bitmap", trace);
   }
 
   std::string formatSize(size_t bytes) {
@@ -199,6 +5953,8 @@ private:
         << "system <cmd>   - Execute system command\n"
         << "memsize        - Display current memory allocation\n"
         << "resize <size>  - Resize memory allocation (e.g., '1GB', '512MB')\n"
+        << "autogrow [on [factor] [cap] [lowwater%]|off] - Grow the arena when allocation fails\n"
+        << "spill [on [path]|off|<name>] - Overflow tier for files that don't fit in the arena\n"
         << "exit           - Exit the console\n"
         << "\nFile System Commands:\n"
         << "ls             - List files in current directory\n"
@@ -207,12 +5963,172 @@ private:
         << "mkdir <name>   - Create directory\n"
         << "touch <name>   - Create empty file\n"
         << "write <name> <content> - Write content to file\n"
+        << "write <name> - | <<TAG | -n <len> - Stream stdin to EOF, to a TAG line, or exactly len bytes\n"
         << "cat <name>     - Display file content\n"
         << "rm <name>      - Remove file or directory\n"
-        << "df             - Show free space\n"
+        << "align [none|cacheline|4k|2m] [name] - Set default or per-file data alignment\n"
+        << "export <name> <hostfile> - Write a file to the host with unbuffered I/O\n"
+        << "peek.<type>[.be] <offset> [count] - Show typed values (u8..u64, i8..i64, f32, f64)\n"
+        << "poke.<type>[.be] <offset> <values...> - Store typed values\n"
+        << "histogram <offset> <len> | <file|@off:len> - Byte frequency table and entropy\n"
+        << "entropy <file|@off:len> [blocksize] - Per-block entropy profile (default 64KB blocks)\n"
+        << "save <hostfile> [-c] - Save the arena and file table as a sparse image, or compressed chunks with -c\n"
+        << "load <hostfile> - Replace the arena and file table from an image\n"
+        << "diff <a> <b>   - List the byte ranges where two files or @offset:length spans differ\n"
+        << "snapdiff <s1> <s2> - List files changed between two images (. is the live arena)\n"
+        << "migrate <socket-path> - Live-migrate the arena to a console started with --incoming\n"
+        << "replicate <socket-path>|stop - Stream every change to a console started with --follow\n"
+        << "replstatus     - Show replication sequence numbers and lag\n"
+        << "promote        - Turn a read-only replica into a writable console\n"
+        << "serve [<port>|stop] - Serve the tree over HTTP on 127.0.0.1 with ranges and keep-alive\n"
+        << "dump <offset> <len> <hostfile> [-j N] - Write a raw arena range to a host file\n"
+        << "undump <hostfile> <offset> [-j N] - Load a host file into the arena at offset\n"
+        << "sync [-c] <hostdir> <dir> - Update dir from a host directory, writing only changed blocks\n"
+        << "hexenc|hexdec|b64enc|b64dec <file|@off:len> <file|@off> - Convert between binary and text\n"
+        << "df [dir]       - Show free space, or directory usage against quota\n"
+        << "quota <dir> <size> - Limit space used under a directory (0 to clear)\n"
+        << "fragmap        - Show arena layout, free extents and access heat\n"
+        << "fsck [-r]      - Check the file table, extents, free space and quotas; -r repairs\n"
+        << "membench [threads] [size] - Measure bandwidth and latency over free arena space (base pages only)\n"
+        << "allocbench [ops] [seed] - Compare allocator strategies on a churn trace\n"
+        << "stats          - Show per-command timing and counter totals\n"
+        << "prof <command> - Run a command and report its counters\n"
+        << "alloctrack [on|off] - Count heap allocations per command\n"
+        << "time <command> - Report wall, CPU and allocation cost of a command\n"
+        << "repeat <n> <command> - Benchmark a command with output suppressed\n"
         << "exit           - Exit the console\n";
   }
 
+  static PerfSample samplePerf() {
+    PerfSample sample;
+    sample.wall = std::chrono::steady_clock::now();
+    ULONG64 cycles = 0;
+    sample.hasCycles = QueryThreadCycleTime(GetCurrentThread(), &cycles) != 0;
+    sample.cycles = cycles;
+    PROCESS_MEMORY_COUNTERS counters = {};
+    counters.cb = sizeof(counters);
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+      sample.pageFaults = counters.PageFaultCount;
+    }
+    FILETIME creation, exitTime, kernel, user;
+    if (GetProcessTimes(GetCurrentProcess(), &creation, &exitTime, &kernel, &user)) {
+      auto ticks = [](const FILETIME &time) {
+        return (static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime;
+      };
+      sample.cpuSeconds = (ticks(kernel) + ticks(user)) / 1e7;
+    }
+    sample.allocations = allocationCount.load(std::memory_order_relaxed);
+    sample.allocatedBytes = allocationBytes.load(std::memory_order_relaxed);
+    sample.deallocations = deallocationCount.load(std::memory_order_relaxed);
+    return sample;
+  }
+
+  static std::string formatDuration(double seconds) {
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(2);
+    if (seconds < 1e-3) {
+      oss << seconds * 1e6 << " us";
+    } else if (seconds < 1) {
+      oss << seconds * 1e3 << " ms";
+    } else {
+      oss << seconds << " s";
+    }
+    return oss.str();
+  }
+
+  void timeCommand(const std::string &cmdLine) {
+    const PerfSample before = samplePerf();
+    executeCommand(cmdLine);
+    const PerfSample after = samplePerf();
+
+    std::cout << "time: wall "
+              << formatDuration(std::chrono::duration<double>(after.wall - before.wall).count())
+              << ", cpu " << formatDuration(after.cpuSeconds - before.cpuSeconds)
+              << ", " << after.allocations - before.allocations << " allocations ("
+              << after.allocatedBytes - before.allocatedBytes << " bytes)";
+    if (! allocationTracking.load()) {
+      std::cout << " [alloctrack off]";
+    }
+    std::cout << "\n";
+  }
+
+  void repeatCommand(size_t iterations, const std::string &cmdLine) {
+    const size_t warmup = (std::max)(static_cast<size_t>(1), iterations / 10);
+    std::vector<double> samples;
+    samples.reserve(iterations);
+
+    NullBuffer nullBuffer;
+    std::streambuf *original = std::cout.rdbuf(&nullBuffer);
+    outputSuppressed = true;
+
+    for (size_t i = 0; i < warmup; i++) {
+      executeCommand(cmdLine);
+    }
+    const PerfSample before = samplePerf();
+    for (size_t i = 0; i < iterations; i++) {
+      auto start = std::chrono::steady_clock::now();
+      executeCommand(cmdLine);
+      samples.push_back(std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - start)
+                            .count());
+    }
+    const PerfSample after = samplePerf();
+
+    outputSuppressed = false;
+    std::cout.rdbuf(original);
+
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&](double p) {
+      return samples[static_cast<size_t>(p * (samples.size() - 1) + 0.5)];
+    };
+    double total = 0;
+    for (double sample: samples) {
+      total += sample;
+    }
+
+    std::cout << iterations << " runs after " << warmup << " warm-up: "
+              << "min " << formatDuration(samples.front())
+              << ", p50 " << formatDuration(percentile(0.50))
+              << ", p90 " << formatDuration(percentile(0.90))
+              << ", p99 " << formatDuration(percentile(0.99))
+              << ", max " << formatDuration(samples.back())
+              << ", mean " << formatDuration(total / iterations) << "\n"
+              << "per run: cpu "
+              << formatDuration((after.cpuSeconds - before.cpuSeconds) / iterations)
+              << ", " << static_cast<double>(after.allocations - before.allocations) / iterations
+              << " allocations, "
+              << static_cast<double>(after.allocatedBytes - before.allocatedBytes) / iterations
+              << " bytes\n";
+  }
+
+  void displayStats() {
+    if (commandStats.empty()) {
+      std::cout << "No commands recorded yet.\n";
+      return;
+    }
+
+    std::cout << "Command         Calls   Avg wall us    Avg cycles  Page faults"
+                 "  Avg allocs  Avg alloc B   Avg frees\n";
+    for (const auto &pair: commandStats) {
+      const CommandStats &stats = pair.second;
+      std::ostringstream row;
+      row << std::left << std::setw(12) << pair.first << std::right
+          << std::setw(9) << stats.calls << std::fixed << std::setprecision(1)
+          << std::setw(14) << stats.wallSeconds * 1e6 / stats.calls
+          << std::setw(14) << stats.cycles / stats.calls
+          << std::setw(13) << stats.pageFaults
+          << std::setw(12) << static_cast<double>(stats.allocations) / stats.calls
+          << std::setw(13) << static_cast<double>(stats.allocatedBytes) / stats.calls
+          << std::setw(12) << static_cast<double>(stats.deallocations) / stats.calls;
+      std::cout << row.str() << "\n";
+    }
+    if (! allocationTracking.load()) {
+      std::cout << "Allocation tracking is off (enable with 'alloctrack on')\n";
+    }
+    std::cout << "Instructions, LLC and dTLB misses: unavailable (no perf_event "
+                 "counters on this platform)\n";
+  }
+
   size_t parseSize(const std::string &sizeStr) {
     std::istringstream iss(sizeStr);
     double value;
@@ -236,10 +6152,19 @@ private:
     return static_cast<size_t>(value * multiplier);
   }
 
-  void executeCommand(const std::string &cmdLine) {
-    std::istringstream iss(cmdLine);
-    std::string command;
-    iss >> command;
+  bool dispatchCommand(const std::string &command, std::istringstream &iss) {
+    if (! migratedTo.empty()) {
+      std::cout << "The arena now lives in the console behind " << migratedTo << "; exiting\n";
+      running = false;
+      return true;
+    }
+    if (follower.readOnly && ! isReadOnlyCommand(command)) {
+      std::cout << "Read-only replica of " << follower.path << "; use promote to accept writes\n";
+      return true;
+    }
+    if (! isMetadataCommand(command)) {
+      finishImageLoad();
+    }
 
     if (command == "help") {
       displayHelp();
@@ -261,19 +6186,49 @@ private:
       int value;
       iss >> offset >> value;
       if (offset < memorySize) {
+        invalidateHostCopies(offset, 1);
         memory[offset] = static_cast<uint8_t>(value);
+        markDirty(offset, 1);
         std::cout << "Written value " << value << " at offset " << offset
                   << std::endl;
       } else {
         std::cout << "Invalid offset\n";
       }
+    } else if (command.compare(0, 5, "peek.") == 0 || command.compare(0, 5, "poke.") == 0) {
+      std::string typeName = command.substr(5);
+      const bool bigEndian = typeName.size() > 3 && typeName.compare(typeName.size() - 3, 3, ".be") == 0;
+      if (bigEndian || (typeName.size() > 3 && typeName.compare(typeName.size() - 3, 3, ".le") == 0)) {
+        typeName.resize(typeName.size() - 3);
+      }
+
+      size_t offset = SIZE_MAX;
+      iss >> offset;
+      const bool peek = command[1] == 'e';
+      size_t count = 1;
+      std::string values;
+      if (peek) {
+        iss >> count;
+      } else {
+        std::getline(iss >> std::ws, values);
+      }
+      const bool known = withScalarType(typeName, [&](auto type) {
+        using T = decltype(type);
+        if (peek) {
+          peekValues<T>(offset, count, bigEndian);
+        } else {
+          pokeValues<T>(offset, values, bigEndian);
+        }
+      });
+      if (! known) {
+        std::cout << "Unknown type " << typeName << ", expected u8/i8/u16/i16/u32/i32/u64/i64/f32/f64\n";
+      }
     } else if (command == "system") {
       std::string cmd;
       std::getline(iss >> std::ws, cmd);
 
       if (cmd.empty()) {
         std::cout << "No command provided for system execution.\n";
-        return;
+        return true;
       }
 
       std::string envCmd;
@@ -290,11 +6245,306 @@ private:
       std::string sizeStr;
       iss >> sizeStr;
       size_t newSize = parseSize(sizeStr);
-      if (reallocateMemory(newSize)) {
+      const size_t usedEnd = usedDataEnd();
+      if (newSize < usedEnd) {
+        std::cout << "Cannot shrink below used data (" << formatSize(usedEnd)
+                  << ")\n";
+        return true;
+      }
+
+      if (resizeArena(newSize)) {
         std::cout << "Memory resized to " << formatSize(memorySize) << "\n";
       } else {
         std::cout << "Memory resize failed\n";
       }
+    } else if (command == "autogrow") {
+      std::string mode;
+      iss >> mode;
+      if (mode == "on") {
+        double factor = 2.0;
+        std::string capStr;
+        double lowWaterPercent = 0;
+        iss >> factor >> capStr >> lowWaterPercent;
+        autogrow.enabled = true;
+        autogrow.factor = factor > 1.0 ? factor : 2.0;
+        autogrow.cap = capStr.empty() ? memorySize * 8 : parseSize(capStr);
+        autogrow.floor = memorySize;
+        autogrow.lowWater = lowWaterPercent / 100.0;
+      } else if (mode == "off") {
+        autogrow.enabled = false;
+      }
+
+      if (autogrow.enabled) {
+        std::cout << "Autogrow on: factor " << autogrow.factor << ", cap "
+                  << formatSize(autogrow.cap) << ", floor " << formatSize(autogrow.floor);
+        if (autogrow.lowWater > 0) {
+          std::cout << ", shrink below " << autogrow.lowWater * 100 << "% used";
+        }
+        std::cout << "\n";
+      } else {
+        std::cout << "Autogrow off\n";
+      }
+    } else if (command == "spill") {
+      std::string argument;
+      iss >> argument;
+      if (argument == "on") {
+        std::string path;
+        iss >> path;
+        if (path.empty()) {
+          path = "memshell.spill";
+        }
+        if (spill.isOpen()) {
+          std::cout << "Spill tier already on (" << spill.path() << ")\n";
+        } else if (spill.open(path)) {
+          std::cout << "Spilling to " << path << "\n";
+        } else {
+          std::cout << "Could not open spill file " << path << "\n";
+        }
+      } else if (argument == "off") {
+        for (size_t i = 0; i < fileTable.size(); i++) {
+          if (! faultIn(i)) {
+            std::cout << "Not enough arena space to bring " << getFullPath(i)
+                      << " back; spill tier stays on.\n";
+            return true;
+          }
+        }
+        for (auto &file: fileTable) {
+          dropSpillCopy(file);
+        }
+        spill.close();
+        std::cout << "Spill tier off\n";
+      } else if (! argument.empty()) {
+        size_t fileIndex = findFile(argument, currentDir);
+        if (! spill.isOpen()) {
+          std::cout << "Spill tier is off.\n";
+        } else if (fileIndex == SIZE_MAX || fileTable[fileIndex].isDirectory) {
+          std::cout << "File not found.\n";
+        } else if (demoteFile(fileIndex)) {
+          std::cout << "Spilled " << argument << "\n";
+        } else {
+          std::cout << "Could not spill " << argument << "\n";
+        }
+      } else {
+        displaySpillStatus();
+      }
+    } else if (command == "align") {
+      std::string className;
+      std::string fileName;
+      iss >> className >> fileName;
+      if (className.empty()) {
+        std::cout << "Default alignment: " << alignmentName(defaultAlignment) << "\n";
+        return true;
+      }
+
+      const size_t alignment = parseAlignment(className);
+      if (alignment == 0) {
+        std::cout << "Alignment must be none, cacheline, 4k or 2m\n";
+      } else if (fileName.empty()) {
+        defaultAlignment = alignment;
+        std::cout << "Default alignment set to " << className << "\n";
+      } else {
+        size_t fileIndex = findFile(fileName, currentDir);
+        if (fileIndex == SIZE_MAX || fileTable[fileIndex].isDirectory) {
+          std::cout << "File not found.\n";
+          return true;
+        }
+        fileTable[fileIndex].alignment = alignment;
+        if (relocateFile(fileIndex)) {
+          std::cout << fileName << " aligned to " << className << "\n";
+        } else {
+          std::cout << "Not enough space to realign " << fileName << "\n";
+        }
+      }
+    } else if (command == "hexenc" || command == "hexdec" || command == "b64enc" ||
+               command == "b64dec") {
+      std::string source;
+      std::string destination;
+      iss >> source >> destination;
+      if (destination.empty()) {
+        std::cout << "Usage: " << command << " <file|@offset:length> <file|@offset>\n";
+      } else {
+        runCodec(command, source, destination);
+      }
+    } else if (command == "dump" || command == "undump") {
+      std::string first;
+      std::string second;
+      std::string third;
+      iss >> first >> second;
+      if (command == "dump") {
+        iss >> third;
+      }
+      const char *usage = command == "dump" ? "Usage: dump <offset> <length> <hostfile> [-j threads]\n"
+                                            : "Usage: undump <hostfile> <offset> [-j threads]\n";
+      std::string option;
+      size_t threads = 1;
+      if (iss >> option && (option != "-j" || ! (iss >> threads) || threads == 0)) {
+        std::cout << usage;
+        return true;
+      }
+
+      try {
+        if (command == "dump") {
+          const size_t offset = std::stoull(first);
+          const size_t length = std::stoull(second);
+          if (third.empty()) {
+            std::cout << usage;
+          } else if (offset > memorySize || length > memorySize - offset) {
+            std::cout << "Range is outside the arena\n";
+          } else {
+            transferRange(third, offset, length, threads, true);
+          }
+          return true;
+        }
+
+        const size_t offset = std::stoull(second);
+        HANDLE handle = CreateFileA(first.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER size;
+        const bool found = handle != INVALID_HANDLE_VALUE && GetFileSizeEx(handle, &size);
+        if (handle != INVALID_HANDLE_VALUE) {
+          CloseHandle(handle);
+        }
+        if (! found) {
+          std::cout << "Could not open " << first << "\n";
+        } else if (offset > memorySize || static_cast<size_t>(size.QuadPart) > memorySize - offset) {
+          std::cout << first << " (" << formatSize(static_cast<size_t>(size.QuadPart))
+                    << ") does not fit in the arena at offset " << offset << "\n";
+        } else {
+          transferRange(first, offset, static_cast<size_t>(size.QuadPart), threads, false);
+        }
+      } catch (const std::exception &) {
+        std::cout << usage;
+      }
+    } else if (command == "sync") {
+      std::string first;
+      std::string hostDir;
+      std::string target;
+      iss >> first;
+      const bool compareAll = first == "-c";
+      if (compareAll) {
+        iss >> hostDir >> target;
+      } else {
+        hostDir = first;
+        iss >> target;
+      }
+      if (hostDir.empty() || target.empty()) {
+        std::cout << "Usage: sync [-c] <hostdir> <dir>\n";
+      } else {
+        syncFromHost(hostDir, target, compareAll);
+      }
+    } else if (command == "histogram" || command == "entropy") {
+      std::string spec;
+      std::string extra;
+      iss >> spec >> extra;
+      if (command == "histogram" && ! extra.empty() && spec[0] != '@') {
+        spec = "@" + spec + ":" + extra;
+      }
+      ArenaRange range;
+      if (spec.empty()) {
+        std::cout << "Usage: histogram <offset> <length> | histogram <file|@off:len>\n"
+                  << "       entropy <file|@off:len> [blocksize]\n";
+      } else if (resolveRange(spec, range)) {
+        if (range.length == 0) {
+          std::cout << "Range is empty\n";
+        } else if (command == "histogram") {
+          displayHistogram(range);
+        } else {
+          const size_t blockSize = extra.empty() ? 64 * 1024 : parseSize(extra);
+          if (blockSize == 0) {
+            std::cout << "Invalid block size\n";
+          } else {
+            displayEntropy(range, blockSize);
+          }
+        }
+      }
+    } else if (command == "replicate") {
+      std::string path;
+      iss >> path;
+      if (path.empty()) {
+        std::cout << "Usage: replicate <socket-path> | replicate stop\n";
+      } else if (path == "stop") {
+        stopReplication();
+        std::cout << "Replication stopped\n";
+      } else {
+        startReplication(path);
+      }
+    } else if (command == "replstatus") {
+      displayReplicationStatus();
+    } else if (command == "serve") {
+      std::string port;
+      iss >> port;
+      if (port.empty()) {
+        displayServerStatus();
+      } else if (port == "stop") {
+        stopServer();
+        std::cout << "Server stopped\n";
+      } else {
+        uint16_t number = 0;
+        const auto parsed = std::from_chars(port.data(), port.data() + port.size(), number);
+        if (parsed.ec != std::errc() || parsed.ptr != port.data() + port.size()) {
+          std::cout << "Usage: serve <port> | serve stop\n";
+        } else {
+          startServer(number);
+        }
+      }
+    } else if (command == "promote") {
+      if (! follower.readOnly) {
+        std::cout << "This console already accepts writes\n";
+      } else {
+        stopFollowing();
+        follower.readOnly = false;
+        std::cout << "Promoted at sequence " << follower.applied << "; accepting writes\n";
+      }
+    } else if (command == "migrate") {
+      std::string path;
+      iss >> path;
+      if (path.empty()) {
+        std::cout << "Usage: migrate <socket-path>\n";
+      } else {
+        startMigration(path);
+      }
+    } else if (command == "save" || command == "load") {
+      std::string hostPath;
+      iss >> hostPath;
+      if (hostPath.empty()) {
+        std::cout << "Usage: " << command << " <hostfile>\n";
+      } else if (command == "save") {
+        std::string format;
+        iss >> format;
+        if (format == "-c") {
+          saveChunkedImage(hostPath);
+        } else {
+          saveImage(hostPath);
+        }
+      } else if (migrating) {
+        std::cout << "Cannot load while a migration is running\n";
+      } else {
+        loadImage(hostPath);
+      }
+    } else if (command == "diff" || command == "snapdiff") {
+      std::string first;
+      std::string second;
+      iss >> first >> second;
+      if (second.empty()) {
+        std::cout << (command == "diff" ? "Usage: diff <file|@off:len> <file|@off:len>\n"
+                                        : "Usage: snapdiff <image|.> <image|.>\n");
+      } else if (command == "diff") {
+        diffRanges(first, second);
+      } else {
+        snapshotDiff(first, second);
+      }
+    } else if (command == "export") {
+      std::string fileName;
+      std::string hostPath;
+      iss >> fileName >> hostPath;
+      size_t fileIndex = findFile(fileName, currentDir);
+      if (hostPath.empty()) {
+        std::cout << "Usage: export <name> <hostfile>\n";
+      } else if (fileIndex == SIZE_MAX || fileTable[fileIndex].isDirectory) {
+        std::cout << "File not found.\n";
+      } else {
+        exportFile(fileIndex, hostPath);
+      }
     } else if (command == "ls") {
       std::cout << "Contents of " << getFullPath(currentDir) << ":\n";
       for (size_t i = 0; i < fileTable.size(); i++) {
@@ -317,18 +6567,43 @@ private:
     } else if (command == "mkdir") {
       std::string dirName;
       iss >> dirName;
-      fileTable.push_back({"dir", 0, 0, true, currentDir});
+      fileTable.push_back({"dir", 0, 0, true, currentDir, 0, 0,
+                           quotaRootFor(currentDir)});
+      directoryIndex.insert(fileTable, fileTable.size() - 1);
     } else if (command == "touch") {
       std::string fileName;
       iss >> fileName;
-      fileTable.push_back({fileName, 0, 0, false, currentDir});
+      createFile(fileName);
     } else if (command == "write") {
       std::string fileName;
       std::string content;
       iss >> fileName >> content;
       size_t fileIndex = findFile(fileName, currentDir);
       if (fileIndex != SIZE_MAX && ! fileTable[fileIndex].isDirectory) {
-        fileTable[fileIndex].size = content.size();
+        FileEntry &file = fileTable[fileIndex];
+        if (content == "-") {
+          streamInput(fileIndex, SIZE_MAX, "");
+        } else if (content.size() > 2 && content.compare(0, 2, "<<") == 0) {
+          streamInput(fileIndex, SIZE_MAX, content.substr(2));
+        } else if (content == "-n") {
+          size_t length = SIZE_MAX;
+          if (iss >> length && length != SIZE_MAX) {
+            streamInput(fileIndex, length, "");
+          } else {
+            std::cout << "Usage: write <name> -n <length>\n";
+          }
+        } else if (allocateFile(fileIndex, content.size(), true)) {
+          file.lastAccess = accessClock;
+          if (file.spillState == SpillState::Spilled) {
+            spill.write(file.spillOffset, reinterpret_cast<const uint8_t *>(content.data()),
+                        content.size());
+            spillStats.bytesOut += content.size();
+          } else {
+            std::copy(content.begin(), content.end(), memory + file.offset);
+            markDirty(file.offset, content.size());
+            recordAccess(file.offset, content.size());
+          }
+        }
       } else {
         std::cout << "File not found.\n";
       }
@@ -337,7 +6612,26 @@ private:
       iss >> fileName;
       size_t fileIndex = findFile(fileName, currentDir);
       if (fileIndex != SIZE_MAX && ! fileTable[fileIndex].isDirectory) {
-        std::cout << "File content\n";
+        FileEntry &file = fileTable[fileIndex];
+        file.lastAccess = accessClock;
+        if (file.spillState != SpillState::Spilled) {
+          spillStats.residentHits++;
+        }
+
+        if (faultIn(fileIndex)) {
+          writeOutput(memory + file.offset, file.size);
+          recordAccess(file.offset, file.size);
+        } else {
+          std::vector<uint8_t> buffer((std::min)(file.size, static_cast<size_t>(1) << 20));
+          for (size_t done = 0; done < file.size; done += buffer.size()) {
+            const size_t chunk = (std::min)(buffer.size(), file.size - done);
+            if (! spill.read(file.spillOffset + done, buffer.data(), chunk)) {
+              break;
+            }
+            writeOutput(buffer.data(), chunk);
+          }
+        }
+        std::cout << "\n";
       } else {
         std::cout << "File not found.\n";
       }
@@ -345,26 +6639,194 @@ private:
       std::string fileName;
       iss >> fileName;
       size_t fileIndex = findFile(fileName, currentDir);
-      if (fileIndex != SIZE_MAX) {
-        fileTable.erase(fileTable.begin() + fileIndex);
+      if (fileIndex != SIZE_MAX && fileIndex != 0) {
+        removeEntry(fileIndex);
       } else {
         std::cout << "File not found.\n";
       }
     } else if (command == "df") {
-      size_t freeSpace = memorySize;
-      for (const auto &file: fileTable) {
-        freeSpace -= file.size;
+      std::string dirName;
+      iss >> dirName;
+      if (! dirName.empty()) {
+        size_t dirIndex = findDirectory(dirName);
+        if (dirIndex == SIZE_MAX) {
+          std::cout << "Directory not found.\n";
+          return true;
+        }
+
+        const FileEntry &dir = fileTable[dirIndex];
+        if (dir.quota > 0) {
+          std::cout << getFullPath(dirIndex) << ": "
+                    << formatSize(dir.quotaUsed) << " used of "
+                    << formatSize(dir.quota) << " quota ("
+                    << formatSize(dir.quota - (std::min)(dir.quota, dir.quotaUsed))
+                    << " available)\n";
+        } else {
+          std::cout << getFullPath(dirIndex) << ": "
+                    << formatSize(subtreeUsage(dirIndex)) << " used (no quota)\n";
+        }
+        return true;
+      }
+
+      std::cout << "Free space: " << formatSize(allocator.freeBytes()) << " in the arena\n";
+      if (spill.isOpen()) {
+        size_t spilledBytes = 0;
+        for (const auto &file: fileTable) {
+          if (! file.isDirectory && file.spillState == SpillState::Spilled) {
+            spilledBytes += file.size;
+          }
+        }
+        std::cout << "Spill file: " << formatSize(spill.used()) << " used, " << formatSize(spilledBytes)
+                  << " of it by spilled files\n";
+      }
+    } else if (command == "quota") {
+      std::string dirName;
+      std::string sizeStr;
+      iss >> dirName >> sizeStr;
+      size_t dirIndex = findDirectory(dirName);
+      if (dirIndex == SIZE_MAX || sizeStr.empty()) {
+        std::cout << "Usage: quota <dir> <size>\n";
+        return true;
+      }
+
+      size_t quota = parseSize(sizeStr);
+      setQuota(dirIndex, quota);
+      if (quota > 0) {
+        std::cout << "Quota for " << getFullPath(dirIndex) << " set to "
+                  << formatSize(quota) << "\n";
+      } else {
+        std::cout << "Quota for " << getFullPath(dirIndex) << " cleared\n";
+      }
+    } else if (command == "fragmap") {
+      displayFragmap();
+    } else if (command == "fsck") {
+      std::string option;
+      iss >> option;
+      if (! option.empty() && option != "-r") {
+        std::cout << "Usage: fsck [-r]\n";
+      } else if (! option.empty() && follower.readOnly) {
+        std::cout << "A read-only replica cannot repair its file table\n";
+      } else {
+        runFsck(! option.empty());
+      }
+    } else if (command == "membench") {
+      size_t threads = 0;
+      std::string sizeStr;
+      iss >> threads >> sizeStr;
+      if (threads == 0) {
+        threads = (std::max)(1u, std::thread::hardware_concurrency());
       }
-      std::cout << "Free space: " << formatSize(freeSpace) << std::endl;
+      runMemoryBenchmark(threads, sizeStr.empty() ? 256ULL * 1024 * 1024 : parseSize(sizeStr));
     } else if (command == "exit") {
       running = false;
+    } else if (command == "allocbench") {
+      size_t operations = 0;
+      uint64_t seed = 1;
+      iss >> operations >> seed;
+      runAllocatorBenchmark(operations > 0 ? operations : 1000000, seed);
+    } else if (command == "stats") {
+      displayStats();
+    } else if (command == "alloctrack") {
+      std::string mode;
+      iss >> mode;
+      if (mode == "on" || mode == "off") {
+        allocationTracking = mode == "on";
+      }
+      std::cout << "Allocation tracking is " << (allocationTracking.load() ? "on" : "off")
+                << "\n";
     } else {
       std::cout << "Unknown command. Type 'help' for available commands.\n";
+      return false;
+    }
+    return true;
+  }
+
+  void executeCommand(const std::string &cmdLine) {
+    typename Sync::Lock lock(sync);
+    if (! migrationReport.empty()) {
+      std::cout << migrationReport;
+      migrationReport.clear();
+    }
+    std::istringstream iss(cmdLine);
+    std::string command;
+    iss >> command;
+
+    if (command == "time" || command == "repeat") {
+      size_t iterations = 0;
+      if (command == "repeat") {
+        iss >> iterations;
+      }
+      std::string inner;
+      std::getline(iss >> std::ws, inner);
+      if (inner.empty() || (command == "repeat" && iterations == 0)) {
+        std::cout << (command == "time" ? "Usage: time <command>\n"
+                                        : "Usage: repeat <count> <command>\n");
+        return;
+      }
+
+      if (command == "time") {
+        timeCommand(inner);
+      } else {
+        repeatCommand(iterations, inner);
+      }
+      return;
+    }
+
+    if (command == "prof") {
+      std::string inner;
+      std::getline(iss >> std::ws, inner);
+      if (inner.empty()) {
+        std::cout << "Usage: prof <command>\n";
+        return;
+      }
+
+      const PerfSample before = samplePerf();
+      executeCommand(inner);
+      const PerfSample after = samplePerf();
+      std::cout << "prof: wall "
+                << std::chrono::duration_cast<std::chrono::microseconds>(after.wall - before.wall).count()
+                << " us, cycles ";
+      if (before.hasCycles && after.hasCycles) {
+        std::cout << after.cycles - before.cycles;
+      } else {
+        std::cout << "n/a";
+      }
+      std::cout << ", page faults " << after.pageFaults - before.pageFaults
+                << ", instructions n/a, LLC misses n/a, dTLB misses n/a\n";
+      if (allocationTracking.load()) {
+        std::cout << "prof: " << after.allocations - before.allocations
+                  << " allocations (" << after.allocatedBytes - before.allocatedBytes
+                  << " bytes), " << after.deallocations - before.deallocations
+                  << " frees\n";
+      }
+      return;
+    }
+
+    const PerfSample before = samplePerf();
+    accessClock++;
+    if (dispatchCommand(command, iss)) {
+      if (! imageLoad.thread.joinable() && ! follower.readOnly) {
+        maybeShrinkArena();
+        scheduleWriteBack();
+      }
+      if (replication.active) {
+        shipChanges(false);
+      }
+      const PerfSample after = samplePerf();
+      CommandStats &stats = commandStats[command];
+      stats.calls++;
+      stats.wallSeconds += std::chrono::duration<double>(after.wall - before.wall).count();
+      stats.cycles += after.cycles - before.cycles;
+      stats.pageFaults += after.pageFaults - before.pageFaults;
+      stats.allocations += after.allocations - before.allocations;
+      stats.allocatedBytes += after.allocatedBytes - before.allocatedBytes;
+      stats.deallocations += after.deallocations - before.deallocations;
     }
   }
 
+
 public:
-  MemoryConsole(size_t initialSize = 2ULL * 1024 * 1024 * 1024)
+  BasicMemoryConsole(size_t initialSize = 2ULL * 1024 * 1024 * 1024)
       : running(true), currentPosition(0), memorySize(0) {
     if (! reallocateMemory(initialSize)) {
       throw std::runtime_error("Failed to allocate initial memory");
@@ -374,13 +6836,144 @@ public:
     signal(SIGINT, signalHandler);
   }
 
+  ~BasicMemoryConsole() {
+    stopServer();
+    stopReplication();
+    if (follower.receiver.joinable()) {
+      stopFollowing();
+      follower.receiver.join();
+      closesocket(follower.listener);
+      if (follower.socket != INVALID_SOCKET) {
+        closesocket(follower.socket);
+      }
+    }
+    if (migrationThread.joinable()) {
+      migrationThread.join();
+    }
+    if (imageLoad.thread.joinable()) {
+      imageLoad.thread.join();
+    }
+  }
+
+  bool startFollower(const std::string &path) {
+    if (! requireConcurrentBuild("A read-only replica")) {
+      return false;
+    }
+    SOCKET listener = INVALID_SOCKET;
+    const sockaddr_un address = unixAddress(path);
+    DeleteFileA(path.c_str());
+    if (startWinsock()) {
+      listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    }
+    if (listener == INVALID_SOCKET ||
+        bind(listener, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == SOCKET_ERROR ||
+        listen(listener, 1) == SOCKET_ERROR) {
+      std::cout << "Could not listen on " << path << "\n";
+      if (listener != INVALID_SOCKET) {
+        closesocket(listener);
+      }
+      return false;
+    }
+
+    follower.listener = listener;
+    follower.path = path;
+    follower.readOnly = true;
+    follower.receiver = std::thread([this] { followLoop(); });
+    std::cout << "Read-only replica waiting for a primary on " << path << "\n";
+    return true;
+  }
+
+  bool receiveMigration(const std::string &path) {
+    SOCKET listener = INVALID_SOCKET;
+    const sockaddr_un address = unixAddress(path);
+    DeleteFileA(path.c_str());
+    if (startWinsock()) {
+      listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    }
+    if (listener == INVALID_SOCKET ||
+        bind(listener, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == SOCKET_ERROR ||
+        listen(listener, 1) == SOCKET_ERROR) {
+      std::cout << "Could not listen on " << path << "\n";
+      if (listener != INVALID_SOCKET) {
+        closesocket(listener);
+      }
+      return false;
+    }
+
+    std::cout << "Waiting for migration on " << path << "\n";
+    SOCKET socket = accept(listener, nullptr, nullptr);
+    closesocket(listener);
+    DeleteFileA(path.c_str());
+    if (socket == INVALID_SOCKET) {
+      return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    size_t received = 0;
+    bool ok = true;
+    bool committed = false;
+    while (ok && ! committed) {
+      StreamHeader header = {};
+      ok = recvAll(socket, &header, sizeof(header));
+      if (! ok) {
+        break;
+      }
+      switch (header.type) {
+        case StreamRecord::Begin:
+          ok = resetArena(header.length);
+          break;
+        case StreamRecord::Resize:
+          ok = reallocateMemory(header.length);
+          break;
+        case StreamRecord::Pages:
+          ok = header.offset <= memorySize && header.length <= memorySize - header.offset &&
+               recvAll(socket, memory + header.offset, header.length);
+          received += header.length;
+          break;
+        case StreamRecord::Commit: {
+          std::vector<uint8_t> metadata(header.length);
+          ImageMetadata image;
+          ok = recvAll(socket, metadata.data(), metadata.size()) &&
+               deserializeMetadata(metadata.data(), metadata.data() + metadata.size(), image) &&
+               image.memorySize == memorySize;
+          if (ok) {
+            applyMetadata(image);
+            const StreamHeader ack = {StreamRecord::Ack, 0, 0};
+            sendAll(socket, &ack, sizeof(ack));
+            committed = true;
+          }
+          break;
+        }
+        default:
+          ok = false;
+      }
+    }
+    closesocket(socket);
+
+    if (! committed) {
+      std::cout << "Migration stream from " << path << " broke off; starting empty\n";
+      initializeFileSystem();
+      return false;
+    }
+    std::cout << "Received " << formatSize(received) << " of arena pages and "
+              << fileTable.size() - 1 << " entries in "
+              << formatDuration(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count())
+              << "\n";
+    return true;
+  }
+
   void run() {
     std::cout << "Memory Console (Initially allocated: " << formatSize(memorySize) << ")\n"
               << "Type 'help' for available commands\n";
 
     std::string cmdLine;
     while (running) {
-      std::cout << getFullPath(currentDir) << "> ";
+      std::string prompt;
+      {
+        typename Sync::Lock gate(sync);
+        prompt = getFullPath(currentDir);
+      }
+      std::cout << prompt << "> ";
       cmdLine.clear();
 
       while (true) {
@@ -394,7 +6987,11 @@ public:
             std::cout << "\b \b";
           }
         } else if (ch == '\t') {
-          std::string suggestion = completeCommand(cmdLine);
+          std::string suggestion;
+          {
+            typename Sync::Lock gate(sync);
+            suggestion = completeCommand(cmdLine);
+          }
           if (! suggestion.empty()) {
             std::cout << suggestion.substr(cmdLine.length());
             cmdLine = suggestion;
@@ -415,9 +7012,45 @@ public:
   }
 };
 
-int main() {
+#ifdef MEMSHELL_VIRTUAL_BACKING
+using DefaultBacking = VirtualBacking;
+#else
+using DefaultBacking = HeapBacking;
+#endif
+
+#ifdef MEMSHELL_HASHED_INDEX
+using DefaultDirectoryIndex = HashedDirectoryIndex;
+#else
+using DefaultDirectoryIndex = LinearDirectoryIndex;
+#endif
+
+#ifdef MEMSHELL_MULTITHREADED
+using DefaultSync = MultiThreaded;
+#else
+using DefaultSync = SingleThreaded;
+#endif
+
+#if defined(MEMSHELL_BEST_FIT_ALLOCATOR)
+using DefaultAllocator = BestFitAllocator;
+#elif defined(MEMSHELL_BUDDY_ALLOCATOR)
+using DefaultAllocator = BuddyAllocator;
+#elif defined(MEMSHELL_BITMAP_ALLOCATOR)
+using DefaultAllocator = BitmapAllocator;
+#else
+using DefaultAllocator = FirstFitAllocator;
+#endif
+
+using MemoryConsole = BasicMemoryConsole<DefaultAllocator, DefaultDirectoryIndex,
+                                         DefaultBacking, DefaultSync>;
+
+int main(int argc, char *argv[]) {
   try {
     MemoryConsole console;
+    if (argc == 3 && std::string(argv[1]) == "--incoming") {
+      console.receiveMigration(argv[2]);
+    } else if (argc == 3 && std::string(argv[1]) == "--follow") {
+      console.startFollower(argv[2]);
+    }
     console.run();
   } catch (const std::exception &e) {
     std::cerr << "Error: " << e.what() << std::endl;